@@ -0,0 +1,152 @@
+#include "bitmap.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+int bitmap_get(const uint32_t *map, size_t position) {
+    return (map[position / 32] >> (31 - position % 32)) & 1;
+}
+void bitmap_set(uint32_t *map, size_t position) {
+    map[position / 32] |= UINT32_C(1) << (31 - position % 32);
+}
+void bitmap_clear(uint32_t *map, size_t position) {
+    map[position / 32] &= ~(UINT32_C(1) << (31 - position % 32));
+}
+void bitmap_set_run(uint32_t *map, size_t start, size_t len) {
+    while (len > 0 && start % 32 != 0) {
+        bitmap_set(map, start++);
+        --len;
+    }
+    for (; len >= 32; len -= 32, start += 32) {
+        map[start / 32] = UINT32_MAX;
+    }
+    while (len > 0) {
+        bitmap_set(map, start++);
+        --len;
+    }
+}
+void bitmap_clear_run(uint32_t *map, size_t start, size_t len) {
+    while (len > 0 && start % 32 != 0) {
+        bitmap_clear(map, start++);
+        --len;
+    }
+    for (; len >= 32; len -= 32, start += 32) {
+        map[start / 32] = 0;
+    }
+    while (len > 0) {
+        bitmap_clear(map, start++);
+        --len;
+    }
+}
+
+// bits of word `word` that are past nbits read as set, so they are never handed out
+static uint32_t load_word(const uint32_t *map, size_t nbits, size_t word) {
+    size_t first_bit = word * 32;
+    if (first_bit + 32 <= nbits) {
+        return map[word];
+    }
+    if (first_bit >= nbits) {
+        return UINT32_MAX;
+    }
+    return map[word] | (UINT32_MAX >> (nbits - first_bit));
+}
+
+// scans words [word, end) and returns the first clear bit, or -1
+static long scan_words(const uint32_t *map, size_t nbits, size_t word, size_t end) {
+#ifdef __AVX2__
+    const __m256i full = _mm256_set1_epi32(-1);
+    while (word + 8 <= end && (word + 8) * 32 <= nbits) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(map + word));
+        if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, full)) != 0xFFFFFFFFu) {
+            break; // some bit in these 8 words is clear, find it below
+        }
+        word += 8;
+    }
+#endif
+    while (word + 2 <= end) {
+        uint64_t pair = ((uint64_t)load_word(map, nbits, word) << 32) | load_word(map, nbits, word + 1);
+        if (~pair != 0) {
+            return (long)(word * 32 + __builtin_clzll(~pair));
+        }
+        word += 2;
+    }
+    if (word < end) {
+        uint32_t last = load_word(map, nbits, word);
+        if (~last != 0) {
+            return (long)(word * 32 + __builtin_clz(~last));
+        }
+    }
+    return -1;
+}
+
+long bitmap_find_free(const uint32_t *map, size_t nbits, size_t start) {
+    size_t words = (nbits + 31) / 32;
+    if (words == 0) {
+        return -1;
+    }
+    if (start >= nbits) {
+        start = 0;
+    }
+    size_t first = start / 32;
+    // the word holding start may have clear bits before start; only count ones at or after it
+    uint32_t head = load_word(map, nbits, first) | ~(UINT32_MAX >> (start % 32));
+    if (~head != 0) {
+        return (long)(first * 32 + __builtin_clz(~head));
+    }
+    long found = scan_words(map, nbits, first + 1, words);
+    if (found == -1) {
+        found = scan_words(map, nbits, 0, first + 1); // wrap around, including the bits before start
+    }
+    return found;
+}
+
+size_t bitmap_free_run(const uint32_t *map, size_t nbits, size_t start, size_t max) {
+    size_t run = 0;
+    size_t position = start;
+    while (run < max && position < nbits) {
+        size_t skip = position % 32;
+        uint32_t used = load_word(map, nbits, position / 32) << skip; // bits before position shifted out
+        size_t clear = used == 0 ? 32 - skip : (size_t)__builtin_clz(used);
+        if (clear > 32 - skip) {
+            clear = 32 - skip;
+        }
+        run += clear;
+        position += clear;
+        if (clear < 32 - skip) {
+            break; // hit a set bit inside this word
+        }
+    }
+    return run < max ? run : max;
+}
+
+size_t bitmap_popcount(const uint32_t *map, size_t nbits) {
+    size_t count = 0;
+    size_t words = nbits / 32;
+    size_t i = 0;
+#ifdef __AVX2__
+    // each nibble looked up in a 16-entry table, bytes summed into four 64-bit lanes
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i sums = _mm256_setzero_si256();
+    for (; i + 8 <= words; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(map + i));
+        __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    count = _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+#endif
+    for (; i + 2 <= words; i += 2) {
+        uint64_t pair;
+        __builtin_memcpy(&pair, map + i, sizeof(pair));
+        count += __builtin_popcountll(pair);
+    }
+    for (; i < words; ++i) {
+        count += __builtin_popcount(map[i]);
+    }
+    if (nbits % 32) {
+        count += __builtin_popcount(map[words] & ~(UINT32_MAX >> (nbits % 32)));
+    }
+    return count;
+}
@@ -0,0 +1,26 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Allocation bitmaps, shared by wfs and mkfs.
+  Bit `position` lives in the 32-bit word position / 32, at mask
+  1 << (31 - position % 32), which is the layout mkfs has always written.
+  Scans read two of those words as one 64-bit value with the lower-addressed
+  word in the high half, so bit order is preserved and the first free bit of
+  the pair is the number of leading ones. When built with -mavx2, runs of
+  completely full words are skipped 256 bits at a time, and popcount counts
+  256 bits per step.
+*/
+
+int bitmap_get(const uint32_t *map, size_t position);
+void bitmap_set(uint32_t *map, size_t position);
+void bitmap_clear(uint32_t *map, size_t position);
+// sets bits [start, start + len), whole words at a time in the middle
+void bitmap_set_run(uint32_t *map, size_t start, size_t len);
+// clears bits [start, start + len), the same way
+void bitmap_clear_run(uint32_t *map, size_t start, size_t len);
+// first clear bit at or after start, wrapping around to 0; -1 if every bit is set
+long bitmap_find_free(const uint32_t *map, size_t nbits, size_t start);
+// number of consecutive clear bits starting at start, at most max
+size_t bitmap_free_run(const uint32_t *map, size_t nbits, size_t start, size_t max);
+size_t bitmap_popcount(const uint32_t *map, size_t nbits);
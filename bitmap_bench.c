@@ -0,0 +1,112 @@
+#include "bitmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+  Microbenchmark for the bitmap allocator. For each bitmap size the front
+  half is marked allocated (what a filesystem looks like after it has been
+  filled and partly emptied from the end) and then blocks are allocated one
+  at a time, the way wfs_write grows a file. The legacy columns use the
+  per-bit scan from bit 0 that wfs used before, the new columns use the
+  word scan with a next-fit cursor and popcount.
+
+  usage: ./bitmap_bench [max_bits]
+*/
+
+// the original allocator, kept here as the baseline
+static int legacy_get_bitmap(int* ptr, int position) {
+    ptr = ptr + (position / 32);
+    int mask = 1 << (31 - (position % 32));
+    return (*ptr & mask);
+}
+static long legacy_find_first(int *map, long nbits) {
+    for(long i = 0; i < nbits; ++i) {
+        if(!legacy_get_bitmap(map, i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+static void legacy_set_bitmap(int* ptr, int position) {
+    ptr = ptr + (position / 32);
+    int new = 1;
+    for(int i = 0; i < (31 -(position % 32)); ++i) {
+        new = new * 2;
+    }
+    *ptr = *ptr + new;
+}
+static size_t legacy_count(const char* start, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; i++) {
+        for (int j = 0; j < 8; j++) {
+            if ((start[i] & (1 << j)) != 0) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t *make_half_full(size_t nbits) {
+    uint32_t *map = calloc(nbits / 32, sizeof(uint32_t));
+    if (map == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    memset(map, 0xff, nbits / 16); // first half of the words
+    return map;
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_bits = argc > 1 ? strtoul(argv[1], NULL, 0) : (size_t)16 << 20;
+    int allocs = 4096;
+    int legacy_allocs = 16; // the legacy scan is O(n) per call, so it gets fewer iterations
+    volatile size_t sink = 0;
+
+#ifdef __AVX2__
+    printf("scan: avx2\n");
+#else
+    printf("scan: scalar\n");
+#endif
+    printf("%10s %16s %16s %9s %16s %16s\n", "bits", "legacy ns/alloc", "new ns/alloc", "speedup", "legacy count ms", "popcount ms");
+    for (size_t nbits = (size_t)1 << 20; nbits <= max_bits; nbits *= 4) {
+        uint32_t *map = make_half_full(nbits);
+        double start = now();
+        for (int i = 0; i < legacy_allocs; ++i) {
+            long found = legacy_find_first((int*)map, nbits);
+            legacy_set_bitmap((int*)map, found);
+        }
+        double legacy_ns = (now() - start) * 1e9 / legacy_allocs;
+
+        start = now();
+        sink += legacy_count((const char*)map, nbits / 8);
+        double legacy_count_ms = (now() - start) * 1e3;
+        free(map);
+
+        map = make_half_full(nbits);
+        size_t cursor = 0;
+        start = now();
+        for (int i = 0; i < allocs; ++i) {
+            long found = bitmap_find_free(map, nbits, cursor);
+            bitmap_set(map, found);
+            cursor = found + 1;
+        }
+        double new_ns = (now() - start) * 1e9 / allocs;
+
+        start = now();
+        sink += bitmap_popcount(map, nbits);
+        double popcount_ms = (now() - start) * 1e3;
+        free(map);
+
+        printf("%10zu %16.0f %16.1f %8.0fx %16.3f %16.3f\n", nbits, legacy_ns, new_ns, legacy_ns / new_ns, legacy_count_ms, popcount_ms);
+    }
+    return sink == 0;
+}
@@ -0,0 +1,575 @@
+#define _GNU_SOURCE //writer-preferring rwlock
+#include "wfs.h"
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define JOURNAL_INTERVAL_MS (50) // commit period, the most a metadata change waits to be durable
+#define JOURNAL_CHUNK       WFS_JOURNAL_CHUNK // dirty tracking granularity in bytes
+#define JOURNAL_RECORD      (JOURNAL_CHUNK + sizeof(struct wfs_journal_range)) // log bytes a dirty chunk costs at most
+
+int journal_tracking;     // dirty chunks are recorded, with or without a log
+int journal_enabled;      // the image has a log
+int journal_fd;
+char *journal_image;
+size_t journal_image_size;
+off_t journal_header_ptr;
+off_t log_start;
+off_t log_end;
+off_t log_head;           // where the next transaction goes
+uint64_t log_seq;         // seq of the next transaction
+
+/*
+  Operations hold journal_barrier for reading; a commit takes it for writing
+  so it snapshots a state with no operation half done. It is taken before any
+  inode lock. dirty_lock guards the dirty set and is a leaf.
+*/
+pthread_rwlock_t journal_barrier;
+pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned char *dirty_map;   // one bit per chunk of the image: changed since the last commit
+unsigned char *logged_map;  // chunk is in a transaction still in the log
+unsigned char *revoked_map; // chunk was freed and not dirtied since, so its home may hold file data
+struct chunk_list {
+    size_t *chunks;         // chunk numbers, unordered, may repeat
+    size_t count;
+    size_t cap;
+};
+struct chunk_list dirty_list;
+struct chunk_list revoke_list; // freed chunks that an earlier transaction in the log holds
+size_t dirty_high_water;       // wake the commit thread early past this many chunks
+/*
+  Admission. log_needed is what the next transaction would take if every
+  chunk recorded so far were a range of its own, and log_reserved is what
+  the operations in flight may still add, see wfs_step_reserve. An
+  operation only starts while both plus its own reserve fit in the log.
+*/
+size_t log_needed;
+size_t log_reserved;
+size_t step_reserve;
+size_t dir_reserve;
+_Thread_local size_t op_reserve; // what this thread's running operation reserved
+
+/*
+  Epochs number transactions as operations see them: everything done
+  while open_epoch is E goes into the transaction snapshotted as E, and
+  durable_epoch is the last one whose commit is durable.
+*/
+uint64_t open_epoch = 1;  // changes only under journal_barrier held for writing
+uint64_t durable_epoch;
+
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // one commit at a time
+pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+int commit_thread_running;
+int journal_stopping;
+pthread_t commit_thread;
+
+uint64_t journal_checksum(uint64_t seq, const char *body, size_t len) {
+    uint64_t hash = 14695981039346656037ull ^ seq; // FNV-1a seeded with seq
+    for(size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)body[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+int journal_io(int write, int fd, void *buf, size_t len, off_t pos) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t done = write ? pwrite(fd, p, len, pos) : pread(fd, p, len, pos);
+        if (done <= 0) {
+            return -1;
+        }
+        p += done;
+        pos += done;
+        len -= done;
+    }
+    return 0;
+}
+int journal_write_header(int fd, off_t ptr, uint64_t seq) {
+    struct wfs_journal_header header = { WFS_JOURNAL_MAGIC, 0, seq };
+    if (journal_io(1, fd, &header, sizeof(header), ptr) != 0 || fdatasync(fd) != 0) {
+        perror("journal header");
+        return -1;
+    }
+    return 0;
+}
+int chunk_test(const unsigned char *map, size_t chunk) {
+    return (map[chunk / 8] >> (chunk % 8)) & 1;
+}
+void chunk_set(unsigned char *map, size_t chunk, int value) {
+    if (value) {
+        map[chunk / 8] |= 1 << (chunk % 8);
+    } else {
+        map[chunk / 8] &= ~(1 << (chunk % 8));
+    }
+}
+int chunk_append(struct chunk_list *list, size_t chunk) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? 2 * list->cap : 1024;
+        size_t *grown = realloc(list->chunks, cap * sizeof(size_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->chunks = grown;
+        list->cap = cap;
+    }
+    list->chunks[list->count++] = chunk;
+    return 0;
+}
+
+/*
+  Transactions in memory. A range record with WFS_JOURNAL_REVOKE in len has
+  no bytes after it; ranges are chunk aligned except at the image's end.
+*/
+struct wfs_journal_range *range_next(struct wfs_journal_range *range) {
+    char *next = (char *)(range + 1);
+    if (!(range->len & WFS_JOURNAL_REVOKE)) {
+        next += range->len;
+    }
+    return (struct wfs_journal_range *)next;
+}
+int txn_revokes(struct wfs_journal_txn *txn, uint64_t offset) {
+    struct wfs_journal_range *range = (struct wfs_journal_range *)(txn + 1);
+    for(uint32_t i = 0; i < txn->ranges; ++i, range = range_next(range)) {
+        uint64_t len = range->len & ~WFS_JOURNAL_REVOKE;
+        if ((range->len & WFS_JOURNAL_REVOKE) && offset >= range->offset && offset < range->offset + len) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int journal_replay(int fd, const struct wfs_sb *sb) { //redoes committed transactions, before the image is mapped
+    if (!(sb->features & WFS_FEATURE_JOURNAL)) {
+        return 0;
+    }
+    struct wfs_journal_header header;
+    if (journal_io(0, fd, &header, sizeof(header), sb->j_ptr) != 0 || header.magic != WFS_JOURNAL_MAGIC) {
+        printf("journal header is damaged\n");
+        return -1;
+    }
+    size_t size = sb->j_size - sb->block_size;
+    char *log = malloc(size);
+    if (log == NULL || journal_io(0, fd, log, size, sb->j_ptr + sb->block_size) != 0) {
+        perror("journal replay");
+        free(log);
+        return -1;
+    }
+    // find the committed transactions first, a later revoke cancels an earlier copy
+    struct wfs_journal_txn **txns = malloc((size / sizeof(struct wfs_journal_txn) + 1) * sizeof(*txns));
+    if (txns == NULL) {
+        free(log);
+        return -1;
+    }
+    int count = 0;
+    size_t pos = 0;
+    uint64_t seq = header.seq;
+    while (pos + sizeof(struct wfs_journal_txn) <= size) {
+        struct wfs_journal_txn *txn = (struct wfs_journal_txn *)(log + pos);
+        if (txn->magic != WFS_JOURNAL_MAGIC || txn->seq != seq || txn->bytes < sizeof(*txn) || txn->bytes > size - pos
+            || journal_checksum(seq, (char *)(txn + 1), txn->bytes - sizeof(*txn)) != txn->checksum) {
+            break; //torn, never committed, or left over from before the last checkpoint
+        }
+        txns[count++] = txn;
+        pos += txn->bytes;
+        ++seq;
+    }
+    for(int i = 0; i < count; ++i) {
+        struct wfs_journal_range *range = (struct wfs_journal_range *)(txns[i] + 1);
+        for(uint32_t r = 0; r < txns[i]->ranges; ++r, range = range_next(range)) {
+            if (range->len & WFS_JOURNAL_REVOKE) {
+                continue;
+            }
+            for(uint64_t done = 0; done < range->len; done += JOURNAL_CHUNK) {
+                uint64_t len = range->len - done < JOURNAL_CHUNK ? range->len - done : JOURNAL_CHUNK;
+                int revoked = 0;
+                for(int j = i + 1; j < count && !revoked; ++j) {
+                    revoked = txn_revokes(txns[j], range->offset + done);
+                }
+                if (!revoked && journal_io(1, fd, (char *)(range + 1) + done, len, range->offset + done) != 0) {
+                    perror("journal replay");
+                    free(txns);
+                    free(log);
+                    return -1;
+                }
+            }
+        }
+    }
+    free(txns);
+    free(log);
+    if (count > 0) {
+        if (fdatasync(fd) != 0 || journal_write_header(fd, sb->j_ptr, seq) != 0) {
+            return -1;
+        }
+        printf("journal: replayed %d transactions\n", count);
+    }
+    return 0;
+}
+
+int journal_open(int fd, char *image, size_t image_size, const struct wfs_sb *sb) {
+    journal_fd = fd;
+    journal_image = image;
+    journal_image_size = image_size;
+    size_t map_bytes = image_size / JOURNAL_CHUNK / 8 + 1;
+    dirty_map = calloc(map_bytes, 1);
+    logged_map = calloc(map_bytes, 1);
+    revoked_map = calloc(map_bytes, 1);
+    if (dirty_map == NULL || logged_map == NULL || revoked_map == NULL) {
+        return -1;
+    }
+    journal_tracking = 1;
+    if (!(sb->features & WFS_FEATURE_JOURNAL)) {
+        return 0; //a commit just msyncs the dirty pages of the shared mapping
+    }
+    struct wfs_journal_header header;
+    if (journal_io(0, fd, &header, sizeof(header), sb->j_ptr) != 0) {
+        return -1;
+    }
+    journal_header_ptr = sb->j_ptr;
+    log_start = sb->j_ptr + sb->block_size;
+    log_end = sb->j_ptr + sb->j_size;
+    log_head = log_start;
+    log_seq = header.seq; //replay already moved it past everything in the log
+    dirty_high_water = (log_end - log_start) / 2 / JOURNAL_RECORD;
+    step_reserve = wfs_step_reserve(sb->block_size, sb->inode_size);
+    dir_reserve = wfs_dir_reserve(sb->max_inodes ? sb->max_inodes : sb->num_inodes, sb->block_size, sb->inode_size);
+    log_needed = sizeof(struct wfs_journal_txn);
+    if ((size_t)(log_end - log_start) < dir_reserve) {
+        printf("journal: the log holds %zu bytes, one operation may need %zu; mkfs -j %zu or more makes every commit atomic\n",
+            (size_t)(log_end - log_start), dir_reserve, (dir_reserve + sb->block_size - 1) / sb->block_size + 1);
+    }
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP); //a commit must not starve
+    if (pthread_rwlock_init(&journal_barrier, &attr) != 0) {
+        return -1;
+    }
+    journal_enabled = 1;
+    return 0;
+}
+
+void journal_admit(size_t reserve) { //waits until reserve more bytes surely fit in the next transaction, committing to make room
+    pthread_mutex_lock(&dirty_lock);
+    while (log_needed + log_reserved + reserve > (size_t)(log_end - log_start)
+           && (log_reserved > 0 || log_needed > sizeof(struct wfs_journal_txn))) { //alone in an empty log, nothing more can be done
+        pthread_mutex_unlock(&dirty_lock);
+        journal_commit(); //waits for the operations in flight, so their reserves come back
+        pthread_mutex_lock(&dirty_lock);
+    }
+    log_reserved += reserve;
+    op_reserve = reserve;
+    pthread_mutex_unlock(&dirty_lock);
+}
+void journal_begin() {
+    if (journal_enabled) {
+        journal_admit(step_reserve);
+        pthread_rwlock_rdlock(&journal_barrier);
+    }
+}
+void journal_begin_dir() {
+    if (journal_enabled) {
+        journal_admit(dir_reserve);
+        pthread_rwlock_rdlock(&journal_barrier);
+    }
+}
+void journal_end() {
+    if (journal_enabled) {
+        pthread_rwlock_unlock(&journal_barrier);
+        pthread_mutex_lock(&dirty_lock);
+        log_reserved -= op_reserve;
+        pthread_mutex_unlock(&dirty_lock);
+    }
+}
+uint64_t journal_epoch() { //the transaction the caller's operation belongs to; caller is inside journal_begin
+    return open_epoch;
+}
+uint64_t journal_durable() { //every transaction up to this epoch is committed
+    return __atomic_load_n(&durable_epoch, __ATOMIC_ACQUIRE);
+}
+void epoch_durable(uint64_t epoch) {
+    __atomic_store_n(&durable_epoch, epoch, __ATOMIC_RELEASE);
+}
+int image_chunks(const void *ptr, size_t len, size_t *first, size_t *last) { //chunks spanned by [ptr, ptr + len), 0 if outside the image
+    const char *p = ptr;
+    if (!journal_tracking || len == 0 || p < journal_image || p + len > journal_image + journal_image_size) {
+        return 0;
+    }
+    *first = (p - journal_image) / JOURNAL_CHUNK;
+    *last = (p + len - 1 - journal_image) / JOURNAL_CHUNK;
+    return 1;
+}
+void journal_dirty(const void *ptr, size_t len) { //ptr outside the image (a scratch copy) is ignored
+    size_t first, last;
+    if (!image_chunks(ptr, len, &first, &last)) {
+        return;
+    }
+    pthread_mutex_lock(&dirty_lock);
+    for(size_t chunk = first; chunk <= last; ++chunk) {
+        chunk_set(revoked_map, chunk, 0);
+        if (!chunk_test(dirty_map, chunk) && chunk_append(&dirty_list, chunk) == 0) {
+            chunk_set(dirty_map, chunk, 1);
+            log_needed += JOURNAL_RECORD;
+        }
+    }
+    int wake = journal_enabled && dirty_list.count > dirty_high_water;
+    pthread_mutex_unlock(&dirty_lock);
+    if (wake) {
+        pthread_cond_signal(&wake_cond);
+    }
+}
+void journal_forget(const void *ptr, size_t len) { //the blocks were freed and may be reused for file data
+    size_t first, last;
+    if (!image_chunks(ptr, len, &first, &last)) {
+        return;
+    }
+    pthread_mutex_lock(&dirty_lock);
+    for(size_t chunk = first; chunk <= last; ++chunk) {
+        chunk_set(dirty_map, chunk, 0); //its stale entry in dirty_list is skipped at commit
+        chunk_set(revoked_map, chunk, 1);
+        if (chunk_test(logged_map, chunk) && chunk_append(&revoke_list, chunk) == 0) {
+            log_needed += sizeof(struct wfs_journal_range);
+        }
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+int compare_chunk(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+size_t take_runs(struct chunk_list *list, unsigned char *keep, unsigned char *mark, size_t *chunks) { //sorts list, moves the chunks set in keep (or all) to the front without repeats, returns how many and the number of runs in *chunks. Caller holds dirty_lock
+    if (list->count > 1) {
+        qsort(list->chunks, list->count, sizeof(size_t), compare_chunk);
+    }
+    size_t kept = 0, runs = 0;
+    for(size_t i = 0; i < list->count; ++i) {
+        size_t chunk = list->chunks[i];
+        if ((kept > 0 && list->chunks[kept - 1] == chunk) || (keep != NULL && !chunk_test(keep, chunk))) {
+            continue;
+        }
+        if (keep != NULL) {
+            chunk_set(keep, chunk, 0);
+        }
+        if (mark != NULL) {
+            chunk_set(mark, chunk, 1);
+        }
+        if (kept == 0 || list->chunks[kept - 1] + 1 != chunk) {
+            ++runs;
+        }
+        list->chunks[kept++] = chunk;
+    }
+    *chunks = kept;
+    return runs;
+}
+char *put_runs(char *p, const size_t *chunks, size_t count, int revoke) { //appends one range record per run of consecutive chunks
+    for(size_t i = 0; i < count; ) {
+        size_t run = 1;
+        while (i + run < count && chunks[i + run] == chunks[i] + run) {
+            ++run;
+        }
+        struct wfs_journal_range *range = (struct wfs_journal_range *)p;
+        range->offset = chunks[i] * JOURNAL_CHUNK;
+        range->len = run * JOURNAL_CHUNK;
+        if (range->offset + range->len > journal_image_size) {
+            range->len = journal_image_size - range->offset;
+        }
+        if (revoke) {
+            range->len |= WFS_JOURNAL_REVOKE;
+        } else {
+            memcpy(range + 1, journal_image + range->offset, range->len);
+        }
+        p = (char *)range_next(range);
+        i += run;
+    }
+    return p;
+}
+int write_home(struct wfs_journal_txn *txn) { //writes a committed transaction's ranges to their homes, skipping chunks freed since
+    struct wfs_journal_range *range = (struct wfs_journal_range *)(txn + 1);
+    for(uint32_t i = 0; i < txn->ranges; ++i, range = range_next(range)) {
+        if (range->len & WFS_JOURNAL_REVOKE) {
+            continue;
+        }
+        // under dirty_lock, so a block can't be freed and given file data between the check and the write
+        pthread_mutex_lock(&dirty_lock);
+        for(uint64_t done = 0; done < range->len; done += JOURNAL_CHUNK) {
+            uint64_t len = range->len - done < JOURNAL_CHUNK ? range->len - done : JOURNAL_CHUNK;
+            if (!chunk_test(revoked_map, (range->offset + done) / JOURNAL_CHUNK)
+                && journal_io(1, journal_fd, (char *)(range + 1) + done, len, range->offset + done) != 0) {
+                pthread_mutex_unlock(&dirty_lock);
+                return -1;
+            }
+        }
+        pthread_mutex_unlock(&dirty_lock);
+    }
+    return 0;
+}
+int journal_checkpoint(struct wfs_journal_txn *next) { //home locations are durable, the log can be reused; caller holds commit_lock
+    if (fdatasync(journal_fd) != 0 || journal_write_header(journal_fd, journal_header_ptr, log_seq) != 0) {
+        return -1;
+    }
+    log_head = log_start;
+    // only next, about to be logged, is in the log now
+    pthread_mutex_lock(&dirty_lock);
+    memset(logged_map, 0, journal_image_size / JOURNAL_CHUNK / 8 + 1);
+    struct wfs_journal_range *range = (struct wfs_journal_range *)(next + 1);
+    for(uint32_t i = 0; next != NULL && i < next->ranges; ++i, range = range_next(range)) {
+        if (!(range->len & WFS_JOURNAL_REVOKE)) {
+            for(uint64_t done = 0; done < range->len; done += JOURNAL_CHUNK) {
+                chunk_set(logged_map, (range->offset + done) / JOURNAL_CHUNK, 1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&dirty_lock);
+    return 0;
+}
+int sync_mapping() { //journal_commit without a log: msync the pages holding dirty chunks
+    pthread_mutex_lock(&dirty_lock);
+    size_t count;
+    take_runs(&dirty_list, dirty_map, NULL, &count);
+    size_t *chunks = dirty_list.chunks;
+    dirty_list.chunks = NULL;
+    dirty_list.count = 0;
+    dirty_list.cap = 0;
+    pthread_mutex_unlock(&dirty_lock);
+    long page = sysconf(_SC_PAGESIZE);
+    int rc = 0;
+    for(size_t i = 0; i < count; ) { //one msync per run of pages
+        size_t first = chunks[i] * JOURNAL_CHUNK / page;
+        size_t last = first;
+        while (i < count && chunks[i] * JOURNAL_CHUNK / page <= last + 1) {
+            last = chunks[i] * JOURNAL_CHUNK / page;
+            ++i;
+        }
+        if (msync(journal_image + first * page, (last - first + 1) * page, MS_SYNC) != 0) {
+            rc = -errno;
+        }
+    }
+    free(chunks);
+    return rc;
+}
+int journal_commit() { //commits everything dirtied so far, returns once it is durable
+    if (!journal_enabled) {
+        return journal_tracking ? sync_mapping() : 0;
+    }
+    pthread_mutex_lock(&commit_lock);
+    // snapshot with no operation in flight
+    pthread_rwlock_wrlock(&journal_barrier);
+    pthread_mutex_lock(&dirty_lock);
+    uint64_t epoch = open_epoch;
+    size_t dirty, revoked;
+    size_t dirty_runs = take_runs(&dirty_list, dirty_map, logged_map, &dirty);
+    size_t revoke_runs = take_runs(&revoke_list, NULL, NULL, &revoked);
+    size_t bytes = sizeof(struct wfs_journal_txn) + (dirty_runs + revoke_runs) * sizeof(struct wfs_journal_range) + dirty * JOURNAL_CHUNK;
+    struct wfs_journal_txn *txn = dirty + revoked ? malloc(bytes) : NULL;
+    if (txn != NULL) {
+        char *p = put_runs((char *)(txn + 1), revoke_list.chunks, revoked, 1);
+        p = put_runs(p, dirty_list.chunks, dirty, 0);
+        bytes = p - (char *)txn;
+        dirty_list.count = 0;
+        revoke_list.count = 0;
+        open_epoch++;
+    } else {
+        for(size_t i = 0; i < dirty; ++i) { //left for the next commit
+            chunk_set(dirty_map, dirty_list.chunks[i], 1);
+        }
+        dirty_list.count = dirty;
+        revoke_list.count = revoked;
+    }
+    log_needed = sizeof(struct wfs_journal_txn) + dirty_list.count * JOURNAL_RECORD + revoke_list.count * sizeof(struct wfs_journal_range);
+    pthread_mutex_unlock(&dirty_lock);
+    pthread_rwlock_unlock(&journal_barrier);
+    if (txn == NULL) {
+        if (dirty + revoked == 0) {
+            epoch_durable(epoch - 1); //nothing since the last commit
+        }
+        pthread_mutex_unlock(&commit_lock);
+        return dirty + revoked ? -ENOMEM : 0;
+    }
+    txn->magic = WFS_JOURNAL_MAGIC;
+    txn->ranges = dirty_runs + revoke_runs;
+    txn->seq = log_seq;
+    txn->bytes = bytes;
+    txn->checksum = journal_checksum(log_seq, (char *)(txn + 1), bytes - sizeof(*txn));
+
+    int rc = 0;
+    if (log_head + (off_t)bytes > log_end) {
+        rc = journal_checkpoint(txn);
+    }
+    if (rc == 0 && log_head + (off_t)bytes > log_end) { //only on a log smaller than journal_open asks for: no atomicity, but still durable
+        static int warned;
+        if (!warned) {
+            fprintf(stderr, "journal: a %zu byte transaction does not fit in the log, writing it in place\n", bytes);
+            warned = 1;
+        }
+        rc = write_home(txn) != 0 || fdatasync(journal_fd) != 0 ? -EIO : 0;
+    } else if (rc == 0) {
+        if (journal_io(1, journal_fd, txn, bytes, log_head) != 0 || fdatasync(journal_fd) != 0) { //the commit point
+            rc = -EIO;
+        } else {
+            log_head += bytes;
+            log_seq++;
+            rc = write_home(txn) != 0 ? -EIO : 0; //made durable by a later checkpoint, or redone by replay
+        }
+    }
+    if (rc != 0) {
+        perror("journal commit");
+    } else {
+        epoch_durable(epoch); //the blocks it freed may be reused now
+    }
+    free(txn);
+    pthread_mutex_unlock(&commit_lock);
+    return rc;
+}
+
+void *journal_thread(void *arg) {
+    pthread_mutex_lock(&wake_lock);
+    while (!journal_stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += JOURNAL_INTERVAL_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&wake_cond, &wake_lock, &until);
+        pthread_mutex_unlock(&wake_lock);
+        journal_commit();
+        pthread_mutex_lock(&wake_lock);
+    }
+    pthread_mutex_unlock(&wake_lock);
+    return NULL;
+}
+int journal_start_thread() { //after fuse has daemonized, since fork keeps only the calling thread
+    if (!journal_enabled || commit_thread_running) {
+        return 0;
+    }
+    if (pthread_create(&commit_thread, NULL, journal_thread, NULL) != 0) {
+        return -1;
+    }
+    commit_thread_running = 1;
+    return 0;
+}
+void journal_close() { //final commit and checkpoint, at unmount
+    if (!journal_enabled) {
+        journal_commit();
+        journal_tracking = 0;
+        return;
+    }
+    if (commit_thread_running) {
+        pthread_mutex_lock(&wake_lock);
+        journal_stopping = 1;
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+        pthread_join(commit_thread, NULL);
+        commit_thread_running = 0;
+    }
+    journal_commit();
+    pthread_mutex_lock(&commit_lock);
+    journal_checkpoint(NULL);
+    pthread_mutex_unlock(&commit_lock);
+    journal_enabled = 0;
+    journal_tracking = 0;
+}
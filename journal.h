@@ -0,0 +1,37 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Metadata journal with group commit, used when the image has
+  WFS_FEATURE_JOURNAL. The image is then mapped privately: metadata is
+  changed in memory, and every operation reports the bytes it touched with
+  journal_dirty between journal_begin and journal_end. The commit thread
+  periodically waits for running operations to finish, snapshots every
+  dirty range, writes them to the log as one transaction, syncs once, and
+  only then writes them to their home locations. Many operations therefore
+  share one sync, and a crash leaves either all of a group or none of it.
+  journal_forget is called for every freed block, so a metadata block that
+  becomes file data is neither written back nor replayed over that data.
+  journal_replay redoes committed transactions at mount.
+  journal_epoch names the transaction a running operation belongs to, and
+  journal_durable the last one committed, so a freed block can be kept
+  from reuse until the transaction that freed it is durable.
+  journal_begin admits one step of wfs_step_reserve bytes and
+  journal_begin_dir one name operation of wfs_dir_reserve bytes, committing
+  first if they might not fit in the log with everything already running.
+  Without a journal the mapping is shared and there is no barrier, but dirty
+  chunks are still recorded: journal_commit then msyncs just their pages.
+*/
+
+int journal_replay(int fd, const struct wfs_sb *sb);
+int journal_open(int fd, char *image, size_t image_size, const struct wfs_sb *sb);
+int journal_start_thread();
+void journal_begin();
+void journal_begin_dir();
+void journal_end();
+void journal_dirty(const void *ptr, size_t len);
+void journal_forget(const void *ptr, size_t len);
+uint64_t journal_epoch();
+uint64_t journal_durable();
+int journal_commit();
+void journal_close();
@@ -1,5 +1,7 @@
 #include <sys/stat.h>
 #include "wfs.h"
+#include "bitmap.h"
+#include "populate.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,40 +31,85 @@ size_t roundup32(size_t n) {
     return((n+31) & ~31);
 }
 
-void process_args(int argc, char *argv[], char **disk_img, size_t *num_inodes, size_t *num_blocks) {
-    if (argc != 7) {
-        printf("Usage: %s -d disk_img -i num_inodes -b num_blocks\n", argv[0]);
-        exit(1);
-    }
+#define USAGE "Usage: %s -d disk_img -i num_inodes -b num_blocks [-B block_size] [-e] [-I] [-P] [-j journal_blocks] [-g factor] [-r dir]\n" \
+              "  -B  data block size in bytes, a power of two from 512 to 65536 (default 512)\n" \
+              "  -e  map regular files with extents instead of block pointers\n" \
+              "  -I  store files smaller than the spare inode slot space inline\n" \
+              "  -P  pack the inode table, one cache-line aligned slot per inode instead of 512 bytes\n" \
+              "  -j  reserve journal_blocks blocks for a metadata journal, at least enough for the largest single operation\n" \
+              "  -g  leave room to grow the image online to factor times the inodes and blocks (default 1, no room)\n" \
+              "  -r  copy the files and directories under dir into the new image\n"
 
-    for (int i = 1; i < argc; i += 2) {
-        if (strcmp(argv[i], "-d") == 0) {
-            *disk_img = argv[i + 1];
+struct mkfs_args {
+    char *disk_img;
+    size_t num_inodes;
+    size_t num_blocks;
+    size_t block_size;
+    size_t journal_blocks;
+    size_t inode_size;
+    size_t growth;
+    int features;
+    char *src_dir;
+};
+
+void process_args(int argc, char *argv[], struct mkfs_args *args) {
+    args->disk_img = NULL;
+    args->num_inodes = 0;
+    args->num_blocks = 0;
+    args->block_size = BLOCK_SIZE;
+    args->journal_blocks = 0;
+    args->inode_size = INODE_SLOT;
+    args->growth = 1;
+    args->features = 0;
+    args->src_dir = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-e") == 0) {
+            args->features |= WFS_FEATURE_EXTENTS;
+        } else if (strcmp(argv[i], "-I") == 0) {
+            args->features |= WFS_FEATURE_INLINE;
+        } else if (strcmp(argv[i], "-P") == 0) {
+            args->inode_size = PACKED_INODE_SLOT;
+        } else if (i + 1 == argc) {
+            printf(USAGE, argv[0]);
+            exit(1);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            args->disk_img = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0) {
+            args->src_dir = argv[++i];
         } else if (strcmp(argv[i], "-i") == 0) {
-            // printf("argv[i + 1]: %s\n", argv[i + 1]);
-            *num_inodes = roundup32(atoi(argv[i + 1]));
-            // printf("num_inodes: %ld\n", *num_inodes);
+            args->num_inodes = roundup32(atoi(argv[++i]));
         } else if (strcmp(argv[i], "-b") == 0) {
-            // printf("argv[i + 1]: %s\n", argv[i + 1]);
-            *num_blocks = roundup32(atoi(argv[i + 1]));
-            // printf("num_blocks: %ld\n", *num_blocks);
+            args->num_blocks = roundup32(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-B") == 0) {
+            args->block_size = strtoul(argv[++i], NULL, 0);
+            if (args->block_size < BLOCK_SIZE || args->block_size > MAX_BLOCK_SIZE || (args->block_size & (args->block_size - 1)) != 0) {
+                printf("Block size must be a power of two from %d to %d\n", BLOCK_SIZE, MAX_BLOCK_SIZE);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "-g") == 0) {
+            args->growth = strtoul(argv[++i], NULL, 0);
+            if (args->growth < 1) {
+                printf("The growth factor must be at least 1\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "-j") == 0) {
+            args->journal_blocks = strtoul(argv[++i], NULL, 0);
+            if (args->journal_blocks < 2) {
+                printf("The journal needs at least 2 blocks, a header and a log\n");
+                exit(1);
+            }
         } else {
             printf("Unknown argument: %s\n", argv[i]);
             exit(1);
         }
     }
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 7) {
-        printf("Usage: %s -d disk_img -i num_inodes -b num_blocks\n", argv[0]);
-        return 1;
+    if (args->disk_img == NULL || args->num_inodes == 0 || args->num_blocks == 0) {
+        printf(USAGE, argv[0]);
+        exit(1);
     }
-    char *disk_img;
-    size_t num_inodes;
-    size_t num_blocks;
+}
 
-    process_args(argc, argv, &disk_img, &num_inodes, &num_blocks);
+int format_image(const char *disk_img, size_t num_inodes, size_t inode_size, size_t num_blocks, size_t block_size, size_t journal_blocks, size_t growth, int features) { //also used by the in-process benchmark
 
     int fd = open(disk_img, O_RDWR);
     if (fd == -1) {
@@ -80,43 +127,67 @@ int main(int argc, char *argv[]) {
         perror("mmap");
         return 1;
     }
-    int size_ibitmap = num_inodes / 8;
-    if (num_inodes % 8 != 0) {
+    size_t max_inodes = roundup32(num_inodes * growth); // the bitmaps and inode table have room for online growth
+    size_t max_blocks = roundup32(num_blocks * growth);
+    int size_ibitmap = max_inodes / 8;
+    if (max_inodes % 8 != 0) {
         ++size_ibitmap;
     }
     if (size_ibitmap % 4 != 0) {
         size_ibitmap = size_ibitmap + 4 - (size_ibitmap % 4);
     }
-    int size_dbitmap = num_blocks / 8;
-    if (num_blocks % 8 != 0) {
+    int size_dbitmap = max_blocks / 8;
+    if (max_blocks % 8 != 0) {
         ++size_dbitmap;
     }
     if (size_dbitmap % 4 != 0) {
         size_dbitmap = size_dbitmap + 4 - (size_dbitmap % 4);
     }
     // At the moment, we are 4 byte alligning the bitmaps
-    if (st.st_size < (num_blocks * BLOCK_SIZE + 512 * num_inodes + size_dbitmap + size_ibitmap + sizeof(struct wfs_sb))) {
+    // Inodes start on a cache line, so each slot covers as few lines as it can
+    size_t i_blocks_ptr = (sizeof(struct wfs_sb) + size_ibitmap + size_dbitmap + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+    // The journal and data blocks start on a block_size boundary so 4 KiB blocks line up with pages
+    size_t j_ptr = i_blocks_ptr + inode_size * max_inodes;
+    j_ptr = (j_ptr + block_size - 1) & ~(block_size - 1);
+    size_t d_blocks_ptr = j_ptr + journal_blocks * block_size;
+    if (st.st_size < d_blocks_ptr + num_blocks * block_size) {
         printf("Disk image is too small\n");
         return 1;
     }
+    size_t min_journal = (wfs_dir_reserve(max_inodes, block_size, inode_size) + block_size - 1) / block_size + 1; // a header and a log that holds the largest single operation
+    if (journal_blocks > 0 && journal_blocks < min_journal) {
+        printf("The journal needs at least %zu blocks for %zu inodes of %zu byte blocks, the most one operation can log\n", min_journal, max_inodes, block_size);
+        return 1;
+    }
 
+    memset(img, 0, d_blocks_ptr); // bitmaps, inodes and journal from an earlier mkfs must not survive
     struct wfs_sb *sb = (struct wfs_sb *) img;
     sb->num_inodes = num_inodes;
     sb->num_data_blocks = num_blocks;
     sb->i_bitmap_ptr = sizeof(struct wfs_sb);
-    sb->d_bitmap_ptr = sb->i_bitmap_ptr + (num_inodes / 8);
-    sb->i_blocks_ptr = sb->d_bitmap_ptr + (num_blocks / 8);
-    sb->d_blocks_ptr = sb->i_blocks_ptr + (num_inodes * BLOCK_SIZE);
+    sb->d_bitmap_ptr = sb->i_bitmap_ptr + size_ibitmap;
+    sb->i_blocks_ptr = i_blocks_ptr;
+    sb->inode_size = inode_size;
+    sb->max_inodes = max_inodes;
+    sb->max_data_blocks = max_blocks;
+    sb->d_blocks_ptr = d_blocks_ptr;
+    sb->features = features | WFS_FEATURE_HASHDIR;
+    sb->block_size = block_size;
+    sb->free_inodes = num_inodes - 1; // all but the root
+    sb->free_data_blocks = num_blocks;
+    sb->clean = 1;
+    if (journal_blocks > 0) {
+        sb->features |= WFS_FEATURE_JOURNAL;
+        sb->j_ptr = j_ptr;
+        sb->j_size = journal_blocks * block_size;
+        struct wfs_journal_header *header = (struct wfs_journal_header *)((char *)img + j_ptr);
+        header->magic = WFS_JOURNAL_MAGIC;
+        header->seq = 1; // the log is empty, the first transaction will be 1
+    }
 
     struct wfs_inode *root = (struct wfs_inode *) ((char*) img + sb->i_blocks_ptr);
-    int* mmap_ibitmap = (int*)((char *)img + sb->i_bitmap_ptr);
-    //parsear o bitmap por ints. 
-    *mmap_ibitmap = 1;
-    for(int j = 0; j < 31; ++j) {
-        // printf("mmap_ibitmap is %x\n", *mmap_ibitmap);
-        *mmap_ibitmap = *mmap_ibitmap * 2;
-    }
-    // printf("mmap_ibitmap is %x\n", *mmap_ibitmap);
+    uint32_t* mmap_ibitmap = (uint32_t*)((char *)img + sb->i_bitmap_ptr);
+    bitmap_set(mmap_ibitmap, 0); // root takes inode 0
     root->num = 0; // root inode number is usually 0
     root->mode = S_IFDIR | 0755; // root is a directory with 755 permissions
     root->uid = getuid(); // owner is the current user
@@ -126,7 +197,7 @@ int main(int argc, char *argv[]) {
     root->atim = time(NULL); // current time
     root->mtim = time(NULL); // current time
     root->ctim = time(NULL); // current time
-    for (int i = 0; i < 7; i++) {
+    for (int i = 0; i < N_BLOCKS; i++) {
         root->blocks[i] = 0; // no data blocks yet
     }
 
@@ -140,12 +211,23 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     close(fd);
+    return 0;
+}
+
+#ifndef MKFS_NO_MAIN
+int main(int argc, char *argv[]) {
+    struct mkfs_args args;
+    process_args(argc, argv, &args);
+    int rc = format_image(args.disk_img, args.num_inodes, args.inode_size, args.num_blocks, args.block_size, args.journal_blocks, args.growth, args.features);
+    if (rc == 0 && args.src_dir != NULL) {
+        rc = populate_image(args.disk_img, args.src_dir);
+    }
+    return rc;
     // printf("no segfault\n");
     // char str[] = ".eba.que.legal.";
     // printf("%s\n", strtok(str, "."));
     // printf("%s\n", strtok(NULL, "."));
     // printf("%s\n", strtok(NULL, "."));
     // printf("%lx\n", (unsigned long) strtok(NULL, "."));
-
-    return 0;
 }
+#endif
@@ -0,0 +1,420 @@
+#include "wfs.h"
+#include "bitmap.h"
+#include "populate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define BULK_MAX_THREADS (64)
+
+struct bulk_node {
+    char *path;                  // on the host
+    char name[MAX_NAME];
+    struct stat st;
+    struct bulk_node **children; // directories only, sorted by name
+    int nchildren;
+    int num;                     // inode number in the image
+};
+struct bulk_job { //copies size bytes of path to dst and zeroes the rest of span
+    const char *path;
+    char *dst;
+    size_t size;
+    size_t span;
+};
+
+/* The image being filled, geometry as in wfs's geometry_init */
+char *bulk_image;
+struct wfs_sb *bulk_sb;
+long bulk_block_size;
+long bulk_inode_size;
+long bulk_inline_capacity;
+int bulk_dentries_per_block;
+int bulk_ptrs_per_block;
+long bulk_next_inode;
+long bulk_next_block;
+struct bulk_job *bulk_jobs;
+long bulk_njobs;
+long bulk_next_job;
+int bulk_failed;
+
+int compare_nodes(const void *a, const void *b) {
+    return strcmp((*(struct bulk_node *const *)a)->name, (*(struct bulk_node *const *)b)->name);
+}
+void free_tree(struct bulk_node *node) {
+    for(int i = 0; i < node->nchildren; ++i) {
+        free_tree(node->children[i]);
+    }
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+struct bulk_node *scan_tree(const char *path, const char *name, const struct stat *st) { //NULL after printing why
+    struct bulk_node *node = calloc(1, sizeof(struct bulk_node));
+    if (node == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    node->path = strdup(path);
+    strcpy(node->name, name);
+    node->st = *st;
+    if (!S_ISDIR(st->st_mode)) {
+        return node;
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        free_tree(node);
+        return NULL;
+    }
+    int capacity = 0;
+    int ok = 1;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char *child_path = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        sprintf(child_path, "%s/%s", path, entry->d_name);
+        struct stat child_st;
+        if (lstat(child_path, &child_st) == -1) {
+            perror(child_path);
+            ok = 0;
+        } else if (!S_ISDIR(child_st.st_mode) && !S_ISREG(child_st.st_mode)) {
+            printf("Skipping %s, wfs only stores regular files and directories\n", child_path);
+        } else if (strlen(entry->d_name) >= MAX_NAME) {
+            printf("%s: names are limited to %d bytes\n", child_path, MAX_NAME - 1);
+            ok = 0;
+        } else {
+            if (node->nchildren == capacity) {
+                capacity = capacity ? 2 * capacity : 16;
+                node->children = realloc(node->children, capacity * sizeof(struct bulk_node *));
+            }
+            struct bulk_node *child = scan_tree(child_path, entry->d_name, &child_st);
+            if (child == NULL) {
+                ok = 0;
+            } else {
+                node->children[node->nchildren++] = child;
+            }
+        }
+        free(child_path);
+    }
+    closedir(dir);
+    if (!ok) {
+        free_tree(node);
+        return NULL;
+    }
+    qsort(node->children, node->nchildren, sizeof(struct bulk_node *), compare_nodes); //the same tree always gives the same image
+    return node;
+}
+/*
+  Space. Everything is counted before anything is written, with the same
+  rules the layout below follows.
+*/
+long meta_blocks(long n) { //indirect blocks needed to map n logical blocks through block pointers, -1 past the triple-indirect range
+    if (n <= IND_BLOCK) {
+        return 0;
+    }
+    long p = bulk_ptrs_per_block;
+    n -= IND_BLOCK;
+    long meta = 1; //the single-indirect block
+    if (n <= p) {
+        return meta;
+    }
+    n -= p;
+    long cover = p; //data blocks under one pointer of the top block
+    for(int level = DIND_BLOCK; level <= TIND_BLOCK; ++level) {
+        long span = cover * p;
+        long here = n < span ? n : span;
+        for(long under = span; under > 1; under /= p) { //the top block, then each level of indirect blocks below it
+            meta += (here + under - 1) / under;
+        }
+        n -= here;
+        if (n == 0) {
+            return meta;
+        }
+        cover = span;
+    }
+    return -1;
+}
+long table_blocks(int entries) { //a directory's hash table, kept under the 3/4 load dir_add_entry grows at
+    if (entries == 0) {
+        return 0;
+    }
+    long blocks = 1;
+    while ((long)entries * 4 > blocks * bulk_dentries_per_block * 3) {
+        blocks *= 2;
+    }
+    return blocks;
+}
+int file_uses_extents() {
+    return (bulk_sb->features & WFS_FEATURE_EXTENTS) != 0;
+}
+int count_tree(struct bulk_node *node, size_t *inodes, size_t *blocks) { //adds what node and everything below it takes, -1 if a file is too large
+    *inodes += 1;
+    if (S_ISREG(node->st.st_mode)) {
+        long n = (node->st.st_size + bulk_block_size - 1) / bulk_block_size;
+        if (node->st.st_size <= bulk_inline_capacity) {
+            return 0;
+        }
+        long meta = file_uses_extents() ? 0 : meta_blocks(n);
+        if (meta == -1) {
+            printf("%s is too large for block pointers, format with -e or a larger -B\n", node->path);
+            return -1;
+        }
+        *blocks += n + meta;
+        return 0;
+    }
+    long table = table_blocks(node->nchildren);
+    *blocks += table + meta_blocks(table);
+    for(int i = 0; i < node->nchildren; ++i) {
+        if (count_tree(node->children[i], inodes, blocks) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+/*
+  Layout. Blocks come from a cursor that only moves forward; a run of n
+  blocks mapped through block pointers is followed by its indirect blocks.
+*/
+struct wfs_inode *bulk_inode(int num) {
+    return (struct wfs_inode *)(bulk_image + bulk_sb->i_blocks_ptr + (off_t)num * bulk_inode_size);
+}
+off_t bulk_address(long index) {
+    return bulk_sb->d_blocks_ptr + (off_t)bulk_block_size * index;
+}
+long reserve_blocks(long n) {
+    long first = bulk_next_block;
+    bulk_next_block += n;
+    return first;
+}
+off_t *bulk_slot(struct wfs_inode *inode, long lblk) { //block_slot, with indirect blocks taken from the cursor
+    if (lblk <= D_BLOCK) {
+        return &inode->blocks[lblk];
+    }
+    lblk -= IND_BLOCK;
+    long span = bulk_ptrs_per_block;
+    int level = IND_BLOCK;
+    while (lblk >= span) {
+        lblk -= span;
+        ++level;
+        span *= bulk_ptrs_per_block;
+    }
+    off_t *slot = &inode->blocks[level];
+    for(int depth = level - D_BLOCK; depth > 0; --depth) {
+        if (*slot == 0) {
+            *slot = bulk_address(reserve_blocks(1));
+            memset(bulk_image + *slot, 0, bulk_block_size);
+            inode->used_blocks++;
+        }
+        span /= bulk_ptrs_per_block;
+        slot = ((off_t *)(bulk_image + *slot)) + lblk / span;
+        lblk %= span;
+    }
+    return slot;
+}
+void map_run(struct wfs_inode *inode, long first, long n) { //maps logical blocks [0, n) to data blocks [first, first + n)
+    for(long lblk = 0; lblk < n; ++lblk) {
+        *bulk_slot(inode, lblk) = bulk_address(first + lblk);
+    }
+    inode->used_blocks += n;
+}
+void fill_inode(struct bulk_node *node) {
+    struct wfs_inode *inode = bulk_inode(node->num);
+    memset(inode, 0, bulk_inode_size);
+    inode->num = node->num;
+    inode->mode = node->st.st_mode;
+    inode->uid = node->st.st_uid;
+    inode->gid = node->st.st_gid;
+    inode->nlinks = 1;
+    inode->atim = node->st.st_atime;
+    inode->mtim = node->st.st_mtime;
+    inode->ctim = node->st.st_ctime;
+}
+void layout_file(struct bulk_node *node) {
+    struct wfs_inode *inode = bulk_inode(node->num);
+    long n = (node->st.st_size + bulk_block_size - 1) / bulk_block_size;
+    inode->size = node->st.st_size;
+    struct bulk_job job = { node->path, NULL, node->st.st_size, 0 };
+    if (bulk_inline_capacity > 0 && node->st.st_size <= bulk_inline_capacity) {
+        inode->flags = WFS_INODE_INLINE;
+        job.dst = (char *)(inode + 1);
+        job.span = job.size;
+    } else if (n > 0) {
+        long first = reserve_blocks(n);
+        if (file_uses_extents()) {
+            inode->extents[0].start = first;
+            inode->extents[0].len = n;
+            inode->used_blocks = n;
+        } else {
+            map_run(inode, first, n);
+        }
+        job.dst = bulk_image + bulk_address(first);
+        job.span = n * bulk_block_size;
+    }
+    if (job.size > 0) {
+        bulk_jobs[bulk_njobs++] = job;
+    }
+}
+void layout_dir(struct bulk_node *node) { //node's inode is filled, its children are numbered and laid out here
+    struct wfs_inode *dir = bulk_inode(node->num);
+    for(int i = 0; i < node->nchildren; ++i) {
+        node->children[i]->num = bulk_next_inode++; //siblings are neighbours in the inode table
+        fill_inode(node->children[i]);
+    }
+    long blocks = table_blocks(node->nchildren);
+    long first = reserve_blocks(blocks);
+    map_run(dir, first, blocks);
+    struct wfs_dentry *table = (struct wfs_dentry *)(bulk_image + bulk_address(first));
+    long slots = blocks * bulk_dentries_per_block;
+    memset(table, 0, blocks * bulk_block_size);
+    for(long i = 0; i < slots; ++i) {
+        table[i].num = -1;
+    }
+    dir->nlinks = 2;
+    for(int i = 0; i < node->nchildren; ++i) {
+        struct bulk_node *child = node->children[i];
+        long slot = dir_hash(child->name) & (slots - 1);
+        while (table[slot].num != -1) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        strcpy(table[slot].name, child->name);
+        table[slot].num = child->num;
+        if (S_ISDIR(child->st.st_mode)) {
+            dir->nlinks++;
+        }
+    }
+    dir->dir_blocks = blocks;
+    dir->size = node->nchildren * sizeof(struct wfs_dentry);
+    for(int i = 0; i < node->nchildren; ++i) { //files first, so their data follows the table
+        if (S_ISREG(node->children[i]->st.st_mode)) {
+            layout_file(node->children[i]);
+        }
+    }
+    for(int i = 0; i < node->nchildren; ++i) {
+        if (S_ISDIR(node->children[i]->st.st_mode)) {
+            layout_dir(node->children[i]);
+        }
+    }
+}
+/*
+  Copying. Workers take files off the job list in layout order and read
+  each one straight into the mapped image.
+*/
+void copy_file(struct bulk_job *job) {
+    size_t done = 0;
+    int fd = open(job->path, O_RDONLY);
+    if (fd == -1) {
+        perror(job->path);
+        bulk_failed = 1;
+        return;
+    }
+    while (done < job->size) {
+        ssize_t got = pread(fd, job->dst + done, job->size - done, done);
+        if (got <= 0) {
+            printf("%s: %s\n", job->path, got == 0 ? "shrank while being copied" : strerror(errno));
+            bulk_failed = 1;
+            break;
+        }
+        done += got;
+    }
+    close(fd);
+    memset(job->dst + done, 0, job->span - done); //the tail of the last block reads as zeros, as wfs keeps it
+}
+void *copy_worker(void *arg) {
+    for(;;) {
+        long i = __atomic_fetch_add(&bulk_next_job, 1, __ATOMIC_RELAXED);
+        if (i >= bulk_njobs) {
+            return NULL;
+        }
+        copy_file(&bulk_jobs[i]);
+    }
+}
+int copy_files() {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > BULK_MAX_THREADS) {
+        threads = BULK_MAX_THREADS;
+    }
+    if (threads > bulk_njobs) {
+        threads = bulk_njobs;
+    }
+    pthread_t workers[BULK_MAX_THREADS];
+    long started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, copy_worker, NULL) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        copy_worker(NULL);
+    }
+    for(long i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    return bulk_failed ? -1 : 0;
+}
+
+int populate_image(const char *disk_img, const char *src_dir) {
+    struct stat st;
+    if (stat(src_dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        printf("%s is not a directory\n", src_dir);
+        return 1;
+    }
+    struct bulk_node *root = scan_tree(src_dir, "", &st);
+    if (root == NULL) {
+        return 1;
+    }
+    int fd = open(disk_img, O_RDWR);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("open");
+        return 1;
+    }
+    void *img = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (img == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    bulk_image = (char *)img;
+    bulk_sb = (struct wfs_sb *)img;
+    bulk_block_size = bulk_sb->block_size;
+    bulk_inode_size = bulk_sb->inode_size;
+    bulk_inline_capacity = (bulk_sb->features & WFS_FEATURE_INLINE) ? bulk_inode_size - (long)sizeof(struct wfs_inode) : 0;
+    bulk_dentries_per_block = bulk_block_size / sizeof(struct wfs_dentry);
+    bulk_ptrs_per_block = bulk_block_size / sizeof(off_t);
+
+    size_t inodes = 0;
+    size_t blocks = 0;
+    if (count_tree(root, &inodes, &blocks) != 0) {
+        return 1;
+    }
+    if (inodes > bulk_sb->num_inodes || blocks > bulk_sb->num_data_blocks) {
+        printf("%s needs %zu inodes and %zu data blocks, the image has %zu and %zu\n", src_dir, inodes, blocks, bulk_sb->num_inodes, bulk_sb->num_data_blocks);
+        return 1;
+    }
+    bulk_jobs = calloc(inodes, sizeof(struct bulk_job));
+    root->num = 0;
+    bulk_next_inode = 1;
+    bulk_next_block = 0;
+    fill_inode(root);
+    layout_dir(root);
+    bitmap_set_run((uint32_t *)(bulk_image + bulk_sb->i_bitmap_ptr), 0, bulk_next_inode);
+    bitmap_set_run((uint32_t *)(bulk_image + bulk_sb->d_bitmap_ptr), 0, bulk_next_block);
+    bulk_sb->free_inodes = bulk_sb->num_inodes - bulk_next_inode;
+    bulk_sb->free_data_blocks = bulk_sb->num_data_blocks - bulk_next_block;
+    int rc = copy_files();
+
+    if (msync(img, st.st_size, MS_SYNC) == -1) {
+        perror("msync");
+        rc = -1;
+    }
+    munmap(img, st.st_size);
+    close(fd);
+    free(bulk_jobs);
+    free_tree(root);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+/*
+  Bulk population, mkfs -r. Builds a freshly formatted image from a host
+  directory tree without mounting it: the tree is scanned first, so a tree
+  that does not fit is refused before the image is touched. Then inodes,
+  directory tables and block maps are laid out in one pass over the mapped
+  image, and worker threads read the source files straight into their
+  blocks. Inodes are numbered and blocks handed out front to back: each
+  directory's table is followed by the data of the files in it and then by
+  its subdirectories, and every file gets one contiguous run, so a file is
+  a single extent and each directory sits next to its children.
+  Only regular files and directories are copied, hard links become
+  separate files, and names must fit in a dentry.
+*/
+
+int populate_image(const char *disk_img, const char *src_dir);
@@ -0,0 +1,85 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TRACE_NAME(name) #name,
+const char *trace_op_names[TRACE_NOPS] = { TRACE_OPS(TRACE_NAME) };
+
+#if WFS_TRACE_LEVEL >= 1
+/*
+  One ring per thread. Only the owning thread writes its ring, so a record is
+  filled in place and then published by bumping head. Rings are pushed onto
+  trace_rings with a compare and swap the first time a thread records, and
+  are never freed.
+*/
+struct trace_ring {
+    struct trace_record records[TRACE_RING];
+    uint64_t head; // records ever written, the next one goes to head % TRACE_RING
+    struct trace_ring *next;
+    int thread;
+};
+struct trace_ring *trace_rings;
+int trace_threads;
+_Thread_local struct trace_ring *trace_self;
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+struct trace_ring *trace_ring_get() {
+    if (trace_self == NULL) {
+        struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->thread = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
+        ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        trace_self = ring;
+    }
+    return trace_self;
+}
+void trace_record(int op, int inode, int64_t offset, uint64_t size, int result, uint64_t start) { //start is 0 for events
+    struct trace_ring *ring = trace_ring_get();
+    if (ring == NULL) {
+        return;
+    }
+    uint64_t now = trace_now();
+    struct trace_record *record = &ring->records[ring->head & (TRACE_RING - 1)];
+    record->time = start ? start : now;
+    record->duration = start ? now - start : 0;
+    record->op = op;
+    record->thread = ring->thread;
+    record->inode = inode;
+    record->result = result;
+    record->offset = offset;
+    record->size = size;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+void trace_dump() { //called once no callback is running
+    const char *path = getenv("WFS_TRACE") ? getenv("WFS_TRACE") : "/tmp/wfs.trace";
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        perror(path);
+        return;
+    }
+    struct trace_ring *first = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+    struct trace_file_header header = { TRACE_MAGIC, sizeof(struct trace_record), 0 };
+    for(struct trace_ring *ring = first; ring != NULL; ring = ring->next) {
+        header.records += ring->head < TRACE_RING ? ring->head : TRACE_RING;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    for(struct trace_ring *ring = first; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t oldest = head < TRACE_RING ? 0 : head - TRACE_RING;
+        for(uint64_t i = oldest; i < head; ++i) {
+            fwrite(&ring->records[i & (TRACE_RING - 1)], sizeof(struct trace_record), 1, out);
+        }
+    }
+    fclose(out);
+    printf("trace: %lu records from %d threads written to %s\n", (unsigned long)header.records, trace_threads, path);
+}
+#endif
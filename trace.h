@@ -0,0 +1,60 @@
+#include <stdint.h>
+
+/*
+  Binary operation trace, compiled in by level:
+    WFS_TRACE_LEVEL 0  nothing, the macros expand to no code (default)
+    WFS_TRACE_LEVEL 1  one record per fuse callback, with its duration
+    WFS_TRACE_LEVEL 2  also allocator and directory events inside callbacks
+  Each thread appends fixed-size records to its own ring, so recording takes
+  no lock and never blocks; when a ring is full the oldest records are
+  overwritten. Rings are written to $WFS_TRACE (default /tmp/wfs.trace) when
+  the filesystem is unmounted, and trace_decode prints them.
+*/
+#ifndef WFS_TRACE_LEVEL
+#define WFS_TRACE_LEVEL 0
+#endif
+
+#define TRACE_OPS(X) \
+    X(GETATTR) X(MKNOD) X(MKDIR) X(UNLINK) X(RMDIR) X(READ) X(WRITE) X(READDIR) \
+    X(ALLOC_BLOCK) X(ALLOC_RUN) X(DIR_GROW) X(FALLOCATE) X(RENAME) X(TRUNCATE)
+#define TRACE_ENUM(name) TRACE_##name,
+enum trace_op { TRACE_OPS(TRACE_ENUM) TRACE_NOPS };
+extern const char *trace_op_names[TRACE_NOPS];
+
+struct trace_record {
+    uint64_t time;      /* CLOCK_MONOTONIC ns when the operation started */
+    uint32_t duration;  /* ns, 0 for events */
+    uint16_t op;        /* enum trace_op */
+    uint16_t thread;    /* Ring the record came from */
+    int32_t  inode;     /* -1 if not known */
+    int32_t  result;    /* Return value: bytes, a block index or -errno */
+    int64_t  offset;
+    uint64_t size;
+};
+
+#define TRACE_MAGIC  (0x57465354u) /* "WFST" */
+#define TRACE_RING   (8192)        /* Records per thread, a power of two */
+struct trace_file_header {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t records;
+};
+
+#if WFS_TRACE_LEVEL >= 1
+uint64_t trace_now();
+void trace_record(int op, int inode, int64_t offset, uint64_t size, int result, uint64_t start);
+void trace_dump();
+#define TRACE_BEGIN() uint64_t trace_start = trace_now()
+#define TRACE_END(op, inode, offset, size, result) trace_record(op, inode, offset, size, result, trace_start)
+#define TRACE_DUMP() trace_dump()
+#else
+#define TRACE_BEGIN() do { } while (0)
+#define TRACE_END(op, inode, offset, size, result) ((void)(result))
+#define TRACE_DUMP() do { } while (0)
+#endif
+
+#if WFS_TRACE_LEVEL >= 2
+#define TRACE_EVENT(op, inode, offset, size, result) trace_record(op, inode, offset, size, result, 0)
+#else
+#define TRACE_EVENT(op, inode, offset, size, result) do { } while (0)
+#endif
@@ -0,0 +1,77 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Prints a trace written by wfs built with WFS_TRACE_LEVEL >= 1, one record
+  per line in time order, then a per-operation summary. With -s only the
+  summary is printed.
+*/
+#define USAGE "Usage: %s [-s] trace_file\n"
+
+int compare_time(const void *a, const void *b) {
+    const struct trace_record *x = a, *y = b;
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    int summary_only = argc == 3 && strcmp(argv[1], "-s") == 0;
+    if (argc != 2 + summary_only) {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+    FILE *in = fopen(argv[argc - 1], "rb");
+    if (in == NULL) {
+        perror(argv[argc - 1]);
+        return 1;
+    }
+    struct trace_file_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != TRACE_MAGIC || header.record_size != sizeof(struct trace_record)) {
+        printf("%s is not a wfs trace\n", argv[argc - 1]);
+        return 1;
+    }
+    struct trace_record *records = malloc(header.records * sizeof(struct trace_record) + 1);
+    size_t n = fread(records, sizeof(struct trace_record), header.records, in);
+    fclose(in);
+    if (n != header.records) {
+        printf("trace is truncated, %zu of %lu records\n", n, (unsigned long)header.records);
+    }
+    qsort(records, n, sizeof(struct trace_record), compare_time);
+
+    if (!summary_only) {
+        printf("%14s %6s %-12s %8s %12s %10s %10s %12s\n", "time_us", "thread", "op", "inode", "offset", "size", "result", "duration_us");
+        for(size_t i = 0; i < n; ++i) {
+            struct trace_record *r = &records[i];
+            const char *name = r->op < TRACE_NOPS ? trace_op_names[r->op] : "?";
+            printf("%14.3f %6u %-12s %8d %12ld %10lu %10d %12.3f\n", (r->time - records[0].time) / 1e3, r->thread, name,
+                r->inode, (long)r->offset, (unsigned long)r->size, r->result, r->duration / 1e3);
+        }
+    }
+
+    uint32_t *durations = malloc(n * sizeof(uint32_t) + 1);
+    printf("%-12s %10s %12s %12s %12s %12s\n", "op", "count", "mean_us", "p50_us", "p99_us", "max_us");
+    for(int op = 0; op < TRACE_NOPS; ++op) {
+        size_t count = 0;
+        double total = 0;
+        for(size_t i = 0; i < n; ++i) {
+            if (records[i].op == op) {
+                durations[count++] = records[i].duration;
+                total += records[i].duration;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        qsort(durations, count, sizeof(uint32_t), compare_u32);
+        printf("%-12s %10zu %12.3f %12.3f %12.3f %12.3f\n", trace_op_names[op], count, total / count / 1e3,
+            durations[count / 2] / 1e3, durations[count * 99 / 100] / 1e3, durations[count - 1] / 1e3);
+    }
+    free(durations);
+    free(records);
+    return 0;
+}
@@ -1,21 +1,66 @@
 
+#define _GNU_SOURCE //fallocate
 #include "wfs.h"
+#include "bitmap.h"
+#include "trace.h"
+#include "journal.h"
+#include "writeback.h"
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
 int wfs_getattr(const char *path, struct stat *stbuf);
 int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
 int wfs_mkdir(const char *path, mode_t mode);
 int wfs_rmdir(const char *path);
 int wfs_mknod(const char *path, mode_t mode, dev_t dev);
 int wfs_unlink(const char *path);
+int wfs_rename(const char *from, const char *to);
+int wfs_truncate(const char *path, off_t size);
+int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
 int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
+int wfs_flush(const char *path, struct fuse_file_info *fi);
+int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int wfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi);
+int wfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+int wfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data);
+int wfs_open(const char *path, struct fuse_file_info *fi);
+int wfs_release(const char *path, struct fuse_file_info *fi);
+int wfs_opendir(const char *path, struct fuse_file_info *fi);
+int wfs_releasedir(const char *path, struct fuse_file_info *fi);
+int wfs_utimens(const char *path, const struct timespec tv[2]);
+int wfs_statfs(const char *path, struct statvfs *st);
+void *wfs_init(struct fuse_conn_info *conn);
+void wfs_destroy(void *private_data);
+off_t block_pointer(struct wfs_inode *inode, long lblk);
+off_t map_block(struct wfs_inode *inode, long lblk, long *run, long max_run);
+int uses_extents(struct wfs_inode *inode);
+struct wfs_inode *handle_inode(const char *path, struct fuse_file_info *fi);
+struct dir_listing *handle_listing(struct fuse_file_info *fi);
+void handle_listing_put(struct fuse_file_info *fi);
+void dir_listing_end(struct fuse_file_info *fi, struct dir_listing *own);
+off_t *block_slot(struct wfs_inode *inode, long lblk, int alloc);
+long max_file_blocks();
+void free_inode_data(struct wfs_inode *inode);
+void release_orphans(int scan);
+long truncate_step(struct wfs_inode *inode, long keep);
+void inode_step(struct wfs_inode *inode);
+int write_inode(struct wfs_inode *curr_inode, const char *buf, size_t size, off_t offset);
 char* image;
+size_t image_size; //bytes mapped, up to the last data block the image can grow to
+int image_fd; //the image file, for fd-backed fuse buffers
+int writeback_cache; //--writeback-cache was given and the kernel agreed, see conn_init
 struct wfs_sb* super;
 struct fuse_operations ops = {
     .getattr = wfs_getattr,
@@ -23,32 +68,131 @@ struct fuse_operations ops = {
     .mkdir   = wfs_mkdir,
     .unlink  = wfs_unlink,
     .rmdir   = wfs_rmdir,
+    .rename  = wfs_rename,
     .read    = wfs_read,
     .write   = wfs_write,
     .readdir = wfs_readdir,
+    .init    = wfs_init,
+    .destroy = wfs_destroy,
+    .read_buf  = wfs_read_buf,
+    .write_buf = wfs_write_buf,
+    .flush     = wfs_flush,
+    .fsync     = wfs_fsync,
+    .fsyncdir  = wfs_fsyncdir,
+    .fallocate = wfs_fallocate,
+    .ioctl     = wfs_ioctl,
+    .open       = wfs_open,
+    .release    = wfs_release,
+    .opendir    = wfs_opendir,
+    .releasedir = wfs_releasedir,
+    .utimens    = wfs_utimens,
+    .truncate   = wfs_truncate,
+    .ftruncate  = wfs_ftruncate,
+    .statfs     = wfs_statfs,
 };
-size_t bitmap_count(const char* start, size_t size) {
-  size_t count = 0;
-  for (size_t i = 0; i < size; i++) {
-    for (int j = 0; j < 8; j++) {
-      if ((start[i] & (1 << j)) != 0) {
-        count++;
-      }
+/*
+  Locking. wfs runs under the multithreaded fuse loop, so everything that
+  touches the image is protected:
+    - every inode has a reader/writer lock (inode_locks, indexed by inode
+      number) covering the inode and, for directories, its dentry blocks;
+    - the inode bitmap and the data bitmap each have their own mutex;
+    - each dcache bucket has its own mutex.
+  Lock order: a parent directory is always locked before its child, and two
+  inodes with no parent/child relation are locked in increasing inode number.
+  Bitmap and dcache locks are leaves: nothing else is acquired while holding
+  them. Path walks hold at most one directory read lock at a time.
+  rename is the exception to the order, see dir_rename: it never blocks
+  while holding an inode lock, so it can't be part of a cycle.
+  An operation that changes metadata calls journal_begin before its first
+  inode lock and journal_end after its last, see journal.h.
+*/
+/*
+  Geometry, derived from the superblock at mount. Nothing below assumes a
+  particular block size.
+*/
+long block_size;
+int dentries_per_block;
+int ptrs_per_block;    // off_t pointers in an indirect block
+int extents_per_block; // extent slots in an extent block
+long inode_size;       // inode table stride
+size_t max_inodes;     // what WFS_IOC_GROW can raise num_inodes to
+long inline_capacity;  // file bytes that fit in an inode slot, 0 without WFS_FEATURE_INLINE
+
+void geometry_init() {
+    block_size = super->block_size ? super->block_size : BLOCK_SIZE;
+    dentries_per_block = block_size / sizeof(struct wfs_dentry);
+    ptrs_per_block = block_size / sizeof(off_t);
+    extents_per_block = block_size / sizeof(struct wfs_extent);
+    inode_size = super->inode_size ? super->inode_size : INODE_SLOT;
+    max_inodes = super->max_inodes ? super->max_inodes : super->num_inodes;
+    inline_capacity = (super->features & WFS_FEATURE_INLINE) ? inode_size - (long)sizeof(struct wfs_inode) : 0;
+}
+struct wfs_inode *inode_at(int num) { //the only place that knows where inodes live
+    return (struct wfs_inode *)(image + super->i_blocks_ptr + (off_t)num * inode_size);
+}
+char *inline_data(struct wfs_inode *inode) { //the spare slot bytes after the inode, see WFS_INODE_INLINE
+    return (char *)(inode + 1);
+}
+off_t block_address(long index) { //byte offset of data block index
+    return super->d_blocks_ptr + (off_t)block_size * index;
+}
+long block_index(off_t address) {
+    return (address - super->d_blocks_ptr) / block_size;
+}
+pthread_rwlock_t *inode_locks;
+unsigned long *map_gens; //per inode, bumped whenever blocks leave its map, see struct map_cursor
+unsigned long *nlookups;    //per inode, entry replies the kernel has not forgotten, see inode_release
+unsigned long *open_counts; //per inode, open handles
+unsigned long *inode_gens;  //per inode number, bumped each time it is handed out; the fuse generation
+pthread_mutex_t ibitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t dbitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int locks_init() {
+    inode_locks = malloc(sizeof(pthread_rwlock_t) * max_inodes); //enough for any growth, so the array never moves
+    map_gens = calloc(max_inodes, sizeof(unsigned long));
+    nlookups = calloc(max_inodes, sizeof(unsigned long));
+    open_counts = calloc(max_inodes, sizeof(unsigned long));
+    inode_gens = calloc(max_inodes, sizeof(unsigned long));
+    if (inode_locks == NULL || map_gens == NULL || nlookups == NULL || open_counts == NULL || inode_gens == NULL) {
+        return -1;
+    }
+    for(size_t i = 0; i < max_inodes; ++i) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    return 0;
+}
+void inode_rdlock(struct wfs_inode *inode) {
+    pthread_rwlock_rdlock(&inode_locks[inode->num]);
+}
+void inode_wrlock(struct wfs_inode *inode) {
+    pthread_rwlock_wrlock(&inode_locks[inode->num]);
+}
+void inode_unlock(struct wfs_inode *inode) {
+    pthread_rwlock_unlock(&inode_locks[inode->num]);
+}
+void inode_dirty(struct wfs_inode *inode) { //the inode goes out with the next journal commit
+    journal_dirty(inode, sizeof(struct wfs_inode));
+}
+void inode_modified(struct wfs_inode *inode) { //after a write of file data, caller holds the write lock
+    if (!writeback_cache) { //with the writeback cache the kernel owns mtime and sends it through setattr
+        inode->mtim = time(NULL);
+        inode->ctim = inode->mtim;
     }
-  }
-  return count;
+}
+size_t bitmap_count(const char* start, size_t nbits) {
+  return bitmap_popcount((const uint32_t*)start, nbits);
 }
 
 size_t inode_count(char* disk_map) {
   struct wfs_sb* sb = (struct wfs_sb*)disk_map;
   char* i_bitmap = disk_map + sb->i_bitmap_ptr;
-  return bitmap_count(i_bitmap, sb->num_inodes / 8);
+  return bitmap_count(i_bitmap, sb->num_inodes);
 }
 
 size_t data_block_count(char* disk_map) {
   struct wfs_sb* sb = (struct wfs_sb*)disk_map;
   char* d_bitmap = disk_map + sb->d_bitmap_ptr;
-  return bitmap_count(d_bitmap, sb->num_data_blocks / 8);
+  return bitmap_count(d_bitmap, sb->num_data_blocks);
 }
 int get_bitmap(int* ptr, int position) {
     if (ptr == NULL) {
@@ -59,40 +203,57 @@ int get_bitmap(int* ptr, int position) {
         printf("Error: position is negative\n");
         return -1;
     }
-    // printf("position:%d\n", position);
-    ptr = ptr + (position / 32);
-    int mask = 1 << (31 - (position % 32));
-    return (*ptr & mask);
+    return bitmap_get((uint32_t*)ptr, position);
 }
+/*
+  Deferred reuse. With a journal, a freed data block must not be handed
+  out again before the transaction that freed it has committed: file data
+  goes straight to the block's home, and a crash in between would replay
+  the old pointers onto it. So the data allocators search alloc_map, a
+  copy of the data bitmap in which such blocks are still set. Each free
+  is queued in held_runs with the transaction it belongs to, and the
+  allocators clear it in alloc_map once journal_durable() has passed that
+  transaction. An operation that runs out of space while blocks are held
+  commits and tries once more, see retry_alloc. Without a journal
+  alloc_map is the bitmap itself and nothing is held. All of it is under
+  dbitmap_lock.
+*/
+uint32_t *alloc_map;
+struct held_run {
+    long start;
+    long len;
+    uint64_t epoch;   // the transaction that freed the run, see journal_epoch
+};
+struct held_run *held_runs; // a queue, oldest first, so epochs never decrease
+size_t held_first;
+size_t held_count;
+size_t held_cap;
+// next-fit cursors: each search starts where the last allocation of that type ended. Protected by the bitmap's lock
+size_t data_cursor;
+size_t inode_cursor;
 int find_first_available_bitmap(int type) { // type 0 for data, 1 for inode
-    struct wfs_sb *super = (struct wfs_sb *) image;
+    long found;
     if (type) {
-        for(int i = 0; i < super->num_inodes; ++i) {
-            if(!get_bitmap((int*)(image + super->i_bitmap_ptr), i)) {
-                return i;
-            }
+        found = bitmap_find_free((uint32_t*)(image + super->i_bitmap_ptr), super->num_inodes, inode_cursor);
+        if (found != -1) {
+            inode_cursor = found + 1;
         }
     } else {
-        for(int i = 0; i < super->num_data_blocks; ++i) {
-            if(!get_bitmap((int *)(image + super->d_bitmap_ptr), i)) {
-                return i;
-            }
+        found = bitmap_find_free(alloc_map, super->num_data_blocks, data_cursor);
+        if (found != -1) {
+            data_cursor = found + 1;
         }
     }
-    return -1;
+    return (int)found;
 }
 
 int set_bitmap(int* ptr, int position, int value) {
-    ptr = ptr + (position / 32);
-    int new = 1;
-    for(int i = 0; i < (31 -(position % 32)); ++i) {
-        new = new * 2;
-    }
     if (value) {
-        *ptr = *ptr + new;
+        bitmap_set((uint32_t*)ptr, position);
     } else {
-        *ptr = *ptr - new;
+        bitmap_clear((uint32_t*)ptr, position);
     }
+    journal_dirty(ptr + position / 32, sizeof(int));
     return 0;
 }
 void fill_stat(struct wfs_inode *inode, struct stat *stbuf){
@@ -106,193 +267,428 @@ void fill_stat(struct wfs_inode *inode, struct stat *stbuf){
     stbuf->st_mtime = inode->mtim;
     stbuf->st_ctime = inode->ctim;
     stbuf->st_ino = inode->num;
+    stbuf->st_blksize = block_size;
     int blocks = 0;
-    if(!S_ISDIR(inode->mode)) {
-        stbuf->st_blocks = ((inode->size + 511) & (~511)) / 512;
+    if (inode->flags & WFS_INODE_INLINE) {
+        blocks = 0; //the data takes no block of its own
+    } else if(!S_ISDIR(inode->mode)) {
+        blocks = inode->used_blocks; //holes take nothing
     } else {
-        for(int i = 0; i < 7; ++i) {
-            if (inode->blocks[i] != 0) {
-                blocks++;
-            }
-        }
-        stbuf->st_blocks = blocks;
+        blocks = inode->dir_blocks;
     }
+    stbuf->st_blocks = blocks * (block_size / 512); // st_blocks is always in 512-byte units
 }
-void shift_dentries(struct wfs_inode* inode, int blocks, int entry_num) {
-    struct wfs_dentry* entry = ((struct wfs_dentry*)(image + inode->blocks[blocks])) + entry_num;
-    struct wfs_dentry* next_entry = ((struct wfs_dentry*) (image + inode->blocks[blocks])) + entry_num + 1;
-    for(int i = entry_num; i < 16; ++i) {
-        if(next_entry->num == -1) {
-            return;
+/*
+  Dentry cache. Path resolution used to rescan every dentry slot of every
+  directory on the path for each callback. Lookups of (parent inode, name)
+  are cached here, including negative results, in a small set-associative
+  table. An entry with num == -1 says the name does not exist in parent.
+  mkdir/mknod/unlink/rmdir/rename update the cache in place so it never has
+  to be flushed.
+*/
+#define DCACHE_BUCKETS (4096)
+#define DCACHE_WAYS    (4)
+
+struct dcache_entry {
+    int parent; // -1 if the slot is empty
+    int num;    // -1 for a negative entry
+    char name[MAX_NAME];
+};
+struct dcache_bucket {
+    pthread_mutex_t lock;
+    struct dcache_entry ways[DCACHE_WAYS];
+    int victim; // next way to replace when the bucket is full
+};
+struct dcache_bucket dcache[DCACHE_BUCKETS];
+unsigned long dcache_hits;
+unsigned long dcache_neg_hits;
+unsigned long dcache_misses;
+
+void dcache_init() {
+    for(int i = 0; i < DCACHE_BUCKETS; ++i) {
+        for(int j = 0; j < DCACHE_WAYS; ++j) {
+            dcache[i].ways[j].parent = -1;
         }
-        if (i != 15) {
-            entry->num = next_entry->num;
-            strcpy(entry->name, next_entry->name);
-        } else {
-            blocks++;
-            if(blocks >= 8 || inode->blocks[blocks] == 0) {
-                return;
-            } else {
-                next_entry = ((struct wfs_dentry*)(image + inode->blocks[blocks]));
-                entry->num = next_entry->num;
-                strcpy(entry->name, next_entry->name);
-                entry = ((struct wfs_dentry*)(image + inode->blocks[blocks])) - 1;
-            }
+        dcache[i].victim = 0;
+        pthread_mutex_init(&dcache[i].lock, NULL);
+    }
+    dcache_hits = dcache_neg_hits = dcache_misses = 0;
+}
+struct dcache_bucket *dcache_bucket_of(int parent, const char *name) {
+    unsigned int hash = 2166136261u ^ (unsigned int)parent; // FNV-1a seeded with the parent
+    for(const char *c = name; *c; ++c) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return &dcache[hash % DCACHE_BUCKETS];
+}
+struct dcache_entry *dcache_find(struct dcache_bucket *bucket, int parent, const char *name) {
+    for(int i = 0; i < DCACHE_WAYS; ++i) {
+        struct dcache_entry *entry = &bucket->ways[i];
+        if (entry->parent == parent && strcmp(entry->name, name) == 0) {
+            return entry;
         }
-        ++entry;
-        ++next_entry;
     }
+    return NULL;
 }
-struct wfs_inode *find_inode(const char *path){
-    struct wfs_inode *curr_inode = (struct wfs_inode *)(image + super->i_blocks_ptr);
-    if (!strcmp(path, "/")) {
-        return curr_inode;
+// returns 1 and fills num on a hit (num is -1 for a cached miss), 0 if nothing is cached
+int dcache_lookup(int parent, const char *name, int *num) {
+    struct dcache_bucket *bucket = dcache_bucket_of(parent, name);
+    pthread_mutex_lock(&bucket->lock);
+    struct dcache_entry *entry = dcache_find(bucket, parent, name);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&bucket->lock);
+        __atomic_fetch_add(&dcache_misses, 1, __ATOMIC_RELAXED);
+        return 0;
     }
-    char *curr_name = strtok((char * restrict)path, "/");
-    struct wfs_dentry *curr_dentry;
-    int found = 0;
-    int path_length = 0;
-    int path_found = 0;
-    while(curr_name != NULL) {
-        for(int i = 0; i < 7; ++i) { //special case when i == 7, handle it
-            if (curr_inode->blocks[i] == 0) {
-                continue;
-            }
-            curr_dentry = (struct wfs_dentry *) ((int)(curr_inode->blocks[i]) + image);
-            for(int k = 0; k < 16; ++k) {
-                if (curr_dentry->num == -1) {
-                    curr_dentry++;
-                    continue;
-                }
-                if (strcmp(curr_dentry->name, curr_name) == 0) {
-                    int inode = curr_dentry->num;
-                    curr_inode =(struct wfs_inode*)(((char *)(image + super->i_blocks_ptr)) + inode*512);
-                    found = 1;
-                    path_found++;
-                    break;
-                } else {
-                    curr_dentry++;
-                }
-            }
-            if (found) {
-                found = 0;
+    *num = entry->num;
+    pthread_mutex_unlock(&bucket->lock);
+    if (*num == -1) {
+        __atomic_fetch_add(&dcache_neg_hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&dcache_hits, 1, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+void dcache_insert(int parent, const char *name, int num) { //name must fit in MAX_NAME, a cut key would match a different name
+    if (strlen(name) >= MAX_NAME) {
+        return;
+    }
+    struct dcache_bucket *bucket = dcache_bucket_of(parent, name);
+    pthread_mutex_lock(&bucket->lock);
+    struct dcache_entry *entry = dcache_find(bucket, parent, name);
+    if (entry == NULL) {
+        for(int i = 0; i < DCACHE_WAYS; ++i) { //prefer an empty way before evicting
+            if (bucket->ways[i].parent == -1) {
+                entry = &bucket->ways[i];
                 break;
             }
         }
-        curr_name = strtok(NULL, "/");
-        path_length++;
     }
-    if (path_found != path_length) {
-        // printf("retornando null\n");
+    if (entry == NULL) {
+        entry = &bucket->ways[bucket->victim];
+        bucket->victim = (bucket->victim + 1) % DCACHE_WAYS;
+    }
+    entry->parent = parent;
+    entry->num = num;
+    strcpy(entry->name, name);
+    pthread_mutex_unlock(&bucket->lock);
+}
+void dcache_print_stats() {
+    unsigned long lookups = dcache_hits + dcache_neg_hits + dcache_misses;
+    printf("dcache: %lu lookups, %lu hits, %lu negative hits, %lu misses (%.1f%% served from cache)\n",
+        lookups, dcache_hits, dcache_neg_hits, dcache_misses,
+        lookups ? 100.0 * (dcache_hits + dcache_neg_hits) / lookups : 0.0);
+}
+/*
+  Directories are open-addressed hash tables of dentries. The table spans
+  dir_blocks logical blocks, a power of two, mapped like file data so it can
+  grow through the indirect blocks. A name sits in the first free slot at or
+  after its hash (linear probing). The table doubles before it is 3/4 full
+  and removals shift later entries back instead of leaving tombstones, so
+  every probe ends at a free slot within a few steps.
+*/
+long dir_slots(struct wfs_inode *dir) {
+    return (long)dir->dir_blocks * dentries_per_block;
+}
+struct wfs_dentry *dir_slot(struct wfs_inode *dir, long slot) {
+    return (struct wfs_dentry *)(image + block_pointer(dir, slot / dentries_per_block)) + slot % dentries_per_block;
+}
+long dir_probe(struct wfs_inode *dir, const char *name) { //slot holding name, or the free slot where its probe ends; -1 if dir has no table
+    long mask = dir_slots(dir) - 1;
+    if (mask < 0) {
+        return -1;
+    }
+    long slot = dir_hash(name) & mask;
+    struct wfs_dentry *entry;
+    while ((entry = dir_slot(dir, slot))->num != -1 && strcmp(entry->name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+struct wfs_dentry *dir_find(struct wfs_inode *dir, const char *name) {
+    long slot = dir_probe(dir, name);
+    if (slot == -1) {
         return NULL;
     }
-    return curr_inode;
+    struct wfs_dentry *entry = dir_slot(dir, slot);
+    return entry->num == -1 ? NULL : entry;
+}
+int dir_lookup(struct wfs_inode *dir, const char *name) { //returns the inode number of name in dir, -1 if missing. Caller holds dir's lock
+    int num;
+    if (dcache_lookup(dir->num, name, &num)) {
+        return num;
+    }
+    struct wfs_dentry *entry = dir_find(dir, name);
+    num = entry == NULL ? -1 : entry->num;
+    dcache_insert(dir->num, name, num);
+    return num;
+}
+int dir_is_empty(struct wfs_inode *dir) {
+    return dir->size == 0; //size counts the live dentries
 }
-int get_parent_inode(const char *path, struct wfs_inode_and_child* rtvalue, int mode) {
-    //printf("path in get_parent_inode is %s\n", path);
+struct wfs_inode *find_inode(const char *path){ //the returned inode is not locked; NULL with errno ENOENT or ENAMETOOLONG
+    struct wfs_inode *curr_inode = inode_at(0);
+    int err = ENOENT;
     char *copy_path = strdup(path);
-    char *copy_path2 = strdup(path);
-    //char *copy_path3 = strdup(path);
-    struct wfs_inode *curr_inode = (struct wfs_inode *)((char *)image + super->i_blocks_ptr);
-    char *curr_name = strtok((char * restrict)copy_path, "/");
-    struct wfs_dentry *curr_dentry;
-    int num_dirs = mode;
-    while (curr_name != NULL) {
-        ++num_dirs;
-        curr_name = strtok(NULL, "/\0");
-    }
-    int found = 0;
-    curr_name = strtok(copy_path2, "/");
-    int path_found = 1;
-    for(int j = 0; j < num_dirs - 1; ++j) {
-        for(int i = 0; i < 7; ++i) { //special case when i == 7, handle it
-            if (curr_inode->blocks[i] == 0) {
-                continue;
-            }
-            curr_dentry = (struct wfs_dentry *) ((int)(curr_inode->blocks[i]) + image);
-            for(int k = 0; k < 16; ++k) {
-                if (curr_dentry->num == -1) {
-                    curr_dentry++;
-                    continue;
-                }
-                if (strcmp(curr_dentry->name, curr_name) == 0) {
-                    int inode = curr_dentry->num;
-                    curr_inode =(struct wfs_inode*) (((char *)(image + super->i_blocks_ptr)) + inode*512);
-                    found = 1;
-                    path_found++;
-                    break;
-                }
-                curr_dentry++;
-            }
-            if (found) {
-                found = 0;
-                break;
-            }
+    char *saveptr;
+    char *curr_name = strtok_r(copy_path, "/", &saveptr);
+    while(curr_name != NULL) {
+        if (!S_ISDIR(curr_inode->mode)) {
+            curr_inode = NULL;
+            break;
         }
-        curr_name = strtok(NULL, "/");
-    }
-    printf("curr_inode->num after loop is %d\n", curr_inode->num);
-    rtvalue->inode = curr_inode; 
-    curr_name = strtok(NULL, "/"); // esse loop aqui ta errado pq curr_name ta null 
-    if(curr_name == NULL) { 
-        curr_name = strdup(path); 
-        curr_name = strtok(curr_name, "/");
-        int offset;
-        if (mode){
-            offset = 2;
+        if (strlen(curr_name) >= MAX_NAME) { //no dentry can hold it, and the dcache must not see it
+            err = ENAMETOOLONG;
+            curr_inode = NULL;
+            break;
         }
-        else {
-            offset = 1;
+        inode_rdlock(curr_inode);
+        int inode = dir_lookup(curr_inode, curr_name);
+        inode_unlock(curr_inode);
+        if (inode == -1) {
+            curr_inode = NULL;
+            break;
         }
-        for(int m = 0; m < num_dirs - offset; ++m) {
-            curr_name = strtok(NULL, "/"); 
-        } 
+        curr_inode = inode_at(inode);
+        curr_name = strtok_r(NULL, "/", &saveptr);
+    }
+    free(copy_path);
+    if (curr_inode == NULL) {
+        errno = err;
+    }
+    return curr_inode;
+}
+int get_parent_inode(const char *path, struct wfs_inode_and_child* rtvalue) { //returns 0 or a negative errno
+    char *copy_path = strdup(path);
+    char *slash = strrchr(copy_path, '/');
+    while (slash != NULL && slash != copy_path && slash[1] == '\0') { //ignore trailing slashes
+        *slash = '\0';
+        slash = strrchr(copy_path, '/');
+    }
+    if (slash == NULL || slash[1] == '\0') {
+        free(copy_path);
+        return -ENOENT;
     }
-    for(int o = 0; o < MAX_NAME; ++o) { 
-        rtvalue->child[o] = curr_name[o]; 
+    if (strlen(slash + 1) >= MAX_NAME) {
+        free(copy_path);
+        return -ENAMETOOLONG;
+    }
+    strcpy(rtvalue->child, slash + 1);
+    if (slash == copy_path) {
+        rtvalue->inode = find_inode("/");
+    } else {
+        *slash = '\0';
+        rtvalue->inode = find_inode(copy_path);
+    }
+    if (rtvalue->inode == NULL) {
+        int err = errno;
+        free(copy_path);
+        return -err;
+    }
+    free(copy_path);
+    if (!S_ISDIR(rtvalue->inode->mode)) {
+        return -ENOTDIR;
     }
-    printf("rtvalue->child is %s\n", rtvalue->child);
     return 0;
 }
-long get_new_data_block(struct wfs_inode* inode) { //returns the new index
-    long i;
-    for(i = 0; i < 8; ++i) {
-        if (inode->blocks[i] == 0) {
-            break;
+/*
+  Free counts. super->free_inodes and super->free_data_blocks follow every
+  bit the allocators flip, under the same bitmap lock and in the same
+  journal transaction, so statfs reads them instead of scanning and a full
+  disk is known without a scan. super->clean is cleared on disk at mount
+  and set again by wfs_destroy once everything is written back; a mount
+  that finds it clear recounts both from the bitmaps.
+*/
+void count_free(size_t *counter, long delta) { //caller holds the lock of the bitmap the counter belongs to
+    *counter += delta;
+    journal_dirty(counter, sizeof(size_t));
+}
+int superblock_write() { //writes the superblock home and syncs it, bypassing the journal
+    if (pwrite(image_fd, super, sizeof(struct wfs_sb), 0) != sizeof(struct wfs_sb) || fdatasync(image_fd) == -1) {
+        return -1;
+    }
+    return 0;
+}
+int free_counts_init() { //at mount, before anything is allocated
+    if (!super->clean) {
+        printf("The image was not unmounted cleanly, recounting free space; wfsck checks it\n");
+        super->free_inodes = super->num_inodes - inode_count(image);
+        super->free_data_blocks = super->num_data_blocks - data_block_count(image);
+        release_orphans(1); //files that were unlinked while open
+    }
+    super->clean = 0;
+    return superblock_write();
+}
+int alloc_map_init(size_t max_blocks, int journaled) { //at mount, before anything is freed
+    uint32_t *map = (uint32_t *)(image + super->d_bitmap_ptr);
+    if (!journaled) {
+        alloc_map = map;
+        return 0;
+    }
+    alloc_map = calloc(max_blocks / 32 + 1, sizeof(uint32_t)); //room for any growth, so it never moves
+    if (alloc_map == NULL) {
+        return -1;
+    }
+    memcpy(alloc_map, map, (super->num_data_blocks + 31) / 32 * sizeof(uint32_t));
+    return 0;
+}
+void hold_run(long start, long len) { //keeps freed blocks from reuse until their transaction commits; caller holds dbitmap_lock
+    if (alloc_map == (uint32_t *)(image + super->d_bitmap_ptr)) {
+        return;
+    }
+    uint64_t epoch = journal_epoch();
+    struct held_run *last = held_count > held_first ? &held_runs[held_count - 1] : NULL;
+    if (last != NULL && last->epoch == epoch && last->start + last->len == start) {
+        last->len += len;
+        return;
+    }
+    if (held_first > 0 && held_count == held_cap) { //slide the queue to the front before growing it
+        memmove(held_runs, held_runs + held_first, (held_count - held_first) * sizeof(struct held_run));
+        held_count -= held_first;
+        held_first = 0;
+    }
+    if (held_count == held_cap) {
+        size_t cap = held_cap ? 2 * held_cap : 256;
+        struct held_run *grown = realloc(held_runs, cap * sizeof(struct held_run));
+        if (grown == NULL) {
+            return; //the run stays set in alloc_map until the next mount, lost but never reused early
         }
+        held_runs = grown;
+        held_cap = cap;
+    }
+    held_runs[held_count++] = (struct held_run){ start, len, epoch };
+}
+void release_held() { //returns the runs whose transactions have committed to alloc_map; caller holds dbitmap_lock
+    uint64_t durable = journal_durable();
+    while (held_first < held_count && held_runs[held_first].epoch <= durable) {
+        bitmap_clear_run(alloc_map, held_runs[held_first].start, held_runs[held_first].len);
+        held_first++;
+    }
+    if (held_first == held_count) {
+        held_first = held_count = 0;
     }
-    int block_index = find_first_available_bitmap(0);
+}
+int retry_alloc(int rc, int *tries) { //after ENOSPC with freed blocks still held, commits so the caller can try once more; caller is outside journal_begin
+    if (rc != -ENOSPC || (*tries)++ > 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&dbitmap_lock);
+    int held = held_count > held_first;
+    pthread_mutex_unlock(&dbitmap_lock);
+    return held && journal_commit() == 0;
+}
+off_t alloc_data_block() { //returns the byte offset of a new block, 0 if the disk is full
+    pthread_mutex_lock(&dbitmap_lock);
+    release_held();
+    int block_index = super->free_data_blocks == 0 ? -1 : find_first_available_bitmap(0);
     if (block_index == -1) {
-        return -1;
+        pthread_mutex_unlock(&dbitmap_lock);
+        return 0;
     }
     set_bitmap((int *)(image + super->d_bitmap_ptr), block_index, 1);
-    inode->blocks[i] = (long) (super->d_blocks_ptr) + 512 * block_index;
-    if(i >= 7) {
-        return (long) (super->d_blocks_ptr) + 512 * block_index; //returns the address if inode that called needs indirect pointers
-    } else {
-        return i; //returns position in the array of blocks if the inode that called can use direct pointers
+    bitmap_set(alloc_map, block_index);
+    count_free(&super->free_data_blocks, -1);
+    pthread_mutex_unlock(&dbitmap_lock);
+    TRACE_EVENT(TRACE_ALLOC_BLOCK, -1, 0, 1, block_index);
+    return block_address(block_index);
+}
+long alloc_data_run(long hint, long want, long *got) { //allocates up to want contiguous blocks at or after hint (-1 for the cursor), returns the first index or -1
+    uint32_t *map = (uint32_t *)(image + super->d_bitmap_ptr);
+    pthread_mutex_lock(&dbitmap_lock);
+    release_held();
+    long start = super->free_data_blocks == 0 ? -1 : bitmap_find_free(alloc_map, super->num_data_blocks, hint == -1 ? data_cursor : (size_t)hint);
+    if (start == -1) {
+        pthread_mutex_unlock(&dbitmap_lock);
+        return -1;
+    }
+    *got = bitmap_free_run(alloc_map, super->num_data_blocks, start, want);
+    bitmap_set_run(map, start, *got);
+    if (alloc_map != map) {
+        bitmap_set_run(alloc_map, start, *got);
     }
+    journal_dirty(map + start / 32, ((start + *got - 1) / 32 - start / 32 + 1) * sizeof(uint32_t));
+    count_free(&super->free_data_blocks, -*got);
+    data_cursor = start + *got;
+    pthread_mutex_unlock(&dbitmap_lock);
+    TRACE_EVENT(TRACE_ALLOC_RUN, -1, hint, *got, start);
+    return start;
+}
+void free_data_run(long start, long len) {
+    uint32_t *map = (uint32_t *)(image + super->d_bitmap_ptr);
+    journal_forget(image + block_address(start), len * block_size); //before the blocks can be handed out again
+    pthread_mutex_lock(&dbitmap_lock);
+    bitmap_clear_run(map, start, len);
+    journal_dirty(map + start / 32, ((start + len - 1) / 32 - start / 32 + 1) * sizeof(uint32_t));
+    count_free(&super->free_data_blocks, len);
+    hold_run(start, len);
+    pthread_mutex_unlock(&dbitmap_lock);
 }
 struct wfs_inode* get_new_inode_block() {
-    int inode = find_first_available_bitmap(1);
+    pthread_mutex_lock(&ibitmap_lock);
+    int inode = super->free_inodes == 0 ? -1 : find_first_available_bitmap(1);
     if(inode == -1) {
+        pthread_mutex_unlock(&ibitmap_lock);
         return NULL;
     }
     set_bitmap((int*)(image + super->i_bitmap_ptr), inode, 1);
-    struct wfs_inode* new_inode = (struct wfs_inode*)(((char *)(image + super->i_blocks_ptr)) + inode*512);
+    count_free(&super->free_inodes, -1);
+    inode_gens[inode]++;
+    pthread_mutex_unlock(&ibitmap_lock);
+    struct wfs_inode* new_inode = inode_at(inode);
     new_inode->num = inode;
     return new_inode;
 }
-int clear_block (char* ptr, int mode) { //0 for directory, 1 for file
-    if (mode) {
-        long* pointer = (long*) ptr;
-        for(int i = 0; i < 64; ++i) {
-            *pointer = 0;
-            ++pointer;
+void free_data_block(off_t address) { //address is the byte offset stored in blocks[]
+    journal_forget(image + address, block_size); //before the block can be handed out again
+    pthread_mutex_lock(&dbitmap_lock);
+    set_bitmap((int *)(image + super->d_bitmap_ptr), block_index(address), 0);
+    count_free(&super->free_data_blocks, 1);
+    hold_run(block_index(address), 1);
+    pthread_mutex_unlock(&dbitmap_lock);
+}
+void free_inode_block(int num) {
+    pthread_mutex_lock(&ibitmap_lock);
+    set_bitmap((int *)(image + super->i_bitmap_ptr), num, 0);
+    count_free(&super->free_inodes, 1);
+    pthread_mutex_unlock(&ibitmap_lock);
+}
+/*
+  File data moves through image_fd and metadata through the mapping. With a
+  journal the mapping is private, so only the journal writes metadata back,
+  and data written through the fd must be read through the fd as well.
+*/
+int image_io(int write, char *buf, size_t len, off_t pos) { //pread/pwrite of exactly len bytes, 0 or a negative errno
+    while (len > 0) {
+        ssize_t done = write ? pwrite(image_fd, buf, len, pos) : pread(image_fd, buf, len, pos);
+        if (done <= 0) {
+            return done < 0 ? -errno : -EIO;
+        }
+        buf += done;
+        pos += done;
+        len -= done;
+    }
+    return 0;
+}
+int zero_blocks(off_t address, long count) { //zeroes data blocks through the fd, see image_io
+    if (fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, address, count * block_size) == 0) {
+        return 0;
+    }
+    static const char zeros[MAX_BLOCK_SIZE];
+    for(long i = 0; i < count; ++i) {
+        int rc = image_io(1, (char *)zeros, block_size, address + i * block_size);
+        if (rc != 0) {
+            return rc;
         }
+    }
+    return 0;
+}
+int clear_block (char* ptr, int mode) { //0 for directory, 1 for an indirect block
+    journal_dirty(ptr, block_size); //also covers whatever the caller stores in it during the same operation
+    if (mode) {
+        memset(ptr, 0, block_size);
     } else {
         struct wfs_dentry* entry = (struct wfs_dentry*) ptr;
-        for (int i = 0; i < 16; ++i) {
+        for (int i = 0; i < dentries_per_block; ++i) {
             entry->num = -1;
             ++entry;
         }
@@ -302,646 +698,2649 @@ int clear_block (char* ptr, int mode) { //0 for directory, 1 for file
 // pega os primeiros 4 bytes do bitmap, cria uma copia na stack, pega a sobra de dividir por 2. Se for impar, o bit 0 ta sendo usado.
 // divide o numero por 2, salva ele na variavel e pega a sobra de dividir por 2. Se for impar, o bit 1 ta sendo usado
 int wfs_getattr(const char *path, struct stat *stbuf) {
-    printf("Calling getattributes\n");
-    
+    TRACE_BEGIN();
     struct wfs_inode *curr_inode = find_inode(path);
     if(curr_inode == NULL) {
-        return -ENOENT;
-    } else {
-        printf("path is %s\n", path);
-        printf("curr_inode->num in get_attr: %d\n",curr_inode->num);
-        printf("curr_inode is: %p\n", (void *)curr_inode);
+        int err = errno;
+        TRACE_END(TRACE_GETATTR, -1, 0, 0, -err);
+        return -err;
     }
+    inode_rdlock(curr_inode);
     fill_stat(curr_inode, stbuf);
-    // printf("stbuf->st_mode is %d\n", stbuf->st_mode);
-    // printf("stbuf->st_uid is %d\n", stbuf->st_uid);
-    // printf("stbuf->st_gid is %d\n", stbuf->st_gid);
-    // printf("stbuf->st_size is %ld\n", stbuf->st_size);
-    // printf("stbuf->st_nlink is %ld\n", stbuf->st_nlink);
-    // printf("stbuf->inode is %ld\n", stbuf->st_ino);
-    // printf("stbuf->st_blocks is %ld\n", stbuf->st_blocks);
-    // printf("node %s exists\n", path);
+    inode_unlock(curr_inode);
+    TRACE_END(TRACE_GETATTR, curr_inode->num, 0, stbuf->st_size, 0);
     return 0;
 }
 
-int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    printf("Calling readdir on path %s\n", path);
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    struct wfs_inode *curr_inode = find_inode(path);
-    
-    if(curr_inode == NULL) {
-        // printf("SHOULD NOT PRINT THIS IN READDIR\n");
-        return -ENOENT;
-    }
-    // printf("curr_inode in readdir: %p\n", (void *)curr_inode);
-    if(!S_ISDIR(curr_inode->mode)) {
-        return -ENOTDIR;
+/*
+  readdir offsets, the same in both frontends: 0 is ".", 1 is "..", and
+  2 + i is the i-th name of the listing, so the kernel can resume anywhere.
+  A listing is a copy of the directory's names, taken when it is read from
+  offset 0 and kept in the open handle until rewound or released. Table
+  slots would not do as offsets: dir_remove_entry moves later entries back
+  into a freed slot and dir_grow rehashes, so "read a batch, unlink those
+  names, read on" could see a name nobody touched move from past the
+  resume offset to before it, and skip it. A name removed after the copy
+  is still listed and one created after it is not, which POSIX allows.
+  A call without a handle (fh 0) copies afresh and has no such guarantee.
+  Entries carry their inode's attributes, filled under the child's read
+  lock while the directory's is held (parent before child).
+*/
+struct dir_listing {
+    struct wfs_dentry *entries; // NULL until the first read
+    long count;
+};
+int dir_listing_take(struct dir_listing *listing, struct wfs_inode *dir) { //copies dir's names, 0 or -ENOMEM; caller holds dir's lock
+    long count = dir->size / sizeof(struct wfs_dentry);
+    struct wfs_dentry *entries = malloc((count + 1) * sizeof(struct wfs_dentry));
+    if (entries == NULL) {
+        return -ENOMEM;
     }
-    // printf("returned curr_inode is %d\n", curr_inode->num);
-    struct wfs_dentry *curr_dentry;
-    for(int i = 0; i < 7; ++i) { //special case when i == 7, handle it
-        if (curr_inode->blocks[i] == 0) {
-            continue;
-        }
-        curr_dentry = (struct wfs_dentry *) ((int)curr_inode->blocks[i] + image);
-        for(int k = 0; k < 16; ++k) { 
-            // printf("curr_dentry->num:%d\n", curr_dentry->num);
-            if (curr_dentry->num == -1) {
-                curr_dentry++;
-                continue;
-            }
-            filler(buf, curr_dentry->name, NULL, 0);
-            curr_dentry++;
+    long n = 0;
+    for(long slot = 0; slot < dir_slots(dir) && n < count; ++slot) {
+        struct wfs_dentry *entry = dir_slot(dir, slot);
+        if (entry->num != -1) {
+            entries[n++] = *entry;
         }
     }
-    // loop throough all dentrys, for each one, copy the name to the buffer
-    // filler(buf, name, NULL, 0);
-    
+    free(listing->entries);
+    listing->entries = entries;
+    listing->count = n;
     return 0;
 }
-
-int wfs_mkdir(const char *path, mode_t mode) {
-    printf("Calling mkdir\n");
-    char *copy_path = strdup(path);
-    struct wfs_inode *inode = find_inode(copy_path); //tries to find inode
-    if (inode != NULL) { //if not null, it already exists
-        return -EEXIST;
+const char *dir_entry_at(struct dir_listing *listing, long pos, int *num) { //name at readdir offset pos, NULL past the end; num is -1 for "." and ".."
+    *num = -1;
+    if (pos < 2) {
+        return pos == 0 ? "." : "..";
     }
-    struct wfs_dentry *curr_dentry;
-    struct wfs_inode_and_child parent;
-    if (get_parent_inode(path, &parent, 1) == -1) { //if parent not found, return enoent
-        return -ENOENT;
+    if (pos - 2 >= listing->count) {
+        return NULL;
     }
-    struct wfs_inode *curr_inode = parent.inode; //inode of the parent
-    char *curr_name = parent.child; //name of the child
-    struct wfs_dentry* free_dentry = NULL;
-    int used_blocks = 0;
-    for(int i = 0; i < 7; ++i) { //Go through each of the parents data blocks
-        if (curr_inode->blocks[i] == 0) { //if 0, not yet allocated, just continue
-            continue;
-        }
-        used_blocks += 1;
-        curr_dentry = (struct wfs_dentry *) ((int)curr_inode->blocks[i] + image); //found a valid block, let's check all directory entries
-        for(int k = 0; k < 16; ++k) { //checks at most 16 directory entries
-            // printf("k is %d\n", k);
-            if (curr_dentry->num == -1) { //if num is -1, not allocated entry. It is a free entry
-                if(free_dentry == NULL) { //if found a free entry, let's use it for our new directory later
-                    free_dentry = curr_dentry;
-                }
-                curr_dentry++; //just continue looking;
-                continue;
-            }
-            curr_dentry++;//loop through all directory entries in this block
-        }
+    *num = listing->entries[pos - 2].num;
+    return listing->entries[pos - 2].name;
+}
+struct dir_listing *dir_listing_begin(struct fuse_file_info *fi, struct dir_listing *own, struct wfs_inode *dir, off_t offset) { //the listing to read at offset, the handle's or own; NULL if out of memory. Caller holds dir's lock
+    struct dir_listing *listing = handle_listing(fi);
+    if (listing == NULL) {
+        listing = own;
     }
-    //name guaranteed to not be used in this directory
-    struct wfs_inode* new_inode = get_new_inode_block(); //gets a new inode for the new directory
-    if(new_inode == NULL) {//if NULL, it is out of space
-        return -ENOSPC;
+    if ((offset == 0 || listing->entries == NULL) && dir_listing_take(listing, dir) != 0) {
+        dir_listing_end(fi, own);
+        return NULL;
     }
-    struct wfs_dentry* entry;
-    if(free_dentry == NULL) {//No free entry, needs more blocks
-        if(used_blocks > 7) { //directory has no blocks left to allocate
-            return -ENOSPC;
-        }
-        long returned = get_new_data_block(curr_inode);
-        if (returned ==  -1) {//no more free blocks in the system
-            //printf("SHOULD NOT BE HERE\n");
-            return -ENOSPC;
+    return listing;
+}
+void dir_listing_end(struct fuse_file_info *fi, struct dir_listing *own) {
+    handle_listing_put(fi);
+    free(own->entries);
+}
+void dir_entry_stat(struct wfs_inode *dir, long pos, int num, struct stat *stbuf) { //caller holds dir's lock
+    if (num == -1) {
+        memset(stbuf, 0, sizeof(struct stat));
+        if (pos == 0) {
+            fill_stat(dir, stbuf);
+        } else {
+            stbuf->st_mode = S_IFDIR; //the parent is not known here
         }
-        clear_block(image + curr_inode->blocks[returned], 0);//making all entries empty
-        entry = (struct wfs_dentry*) (image + curr_inode->blocks[returned]);//setting the entry that will be filled with new directory
-    } else {
-        entry = free_dentry;// there is a free entry, so we will use it
-    }
-    // printf("inside mkdir, curr_inode->num is %d, path is %s\n", curr_inode->num, path);
-    curr_inode->mtim = time(NULL);
-    curr_inode->ctim = time(NULL); //setting new access times, because we are modifying this directory
-    curr_inode->atim = time(NULL);
-    curr_inode->size += sizeof(struct wfs_dentry);
-    curr_inode->nlinks++; //setting new link, because we are creating a child
-    strcpy((char*)entry->name, curr_name); //copying the name of the new directory to the directory entry in the parent
-    entry->num = new_inode->num; //setting the inode of the directory entry
-    new_inode->mode = mode | __S_IFDIR;
-    new_inode->uid = getuid();
-    new_inode->gid = getgid();
-    new_inode->nlinks = 2; // 2 nlinks, because the directory will reference itself and the parent also has a link to it
-    new_inode->mtim = time(NULL);
-    new_inode->ctim = time(NULL);
-    new_inode->atim = time(NULL);
-    new_inode->size = 0;
-    for(int j = 0; j < 7; ++j) { //clearing all blocks to 0
-        new_inode->blocks[j] = 0;
+        return;
     }
-    //printf("curr:%d and new_inode num shows %d and its address is %lx\n", ((struct wfs_dentry *) (image + curr_inode->blocks[0]))->num, new_inode->num, (long unsigned int)new_inode);
-    return 0;
+    struct wfs_inode *child = inode_at(num);
+    inode_rdlock(child);
+    fill_stat(child, stbuf);
+    inode_unlock(child);
 }
-
-int wfs_rmdir(const char *path) {
-    printf("Calling rmdir\n");
-    char *copy_path = strdup(path);
-    struct wfs_inode *curr_inode = find_inode(copy_path);
+int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *curr_inode = handle_inode(path, fi);
     if(curr_inode == NULL) {
-        return -ENOENT;
+        int err = errno;
+        TRACE_END(TRACE_READDIR, -1, offset, 0, -err);
+        return -err;
     }
     if(!S_ISDIR(curr_inode->mode)) {
+        TRACE_END(TRACE_READDIR, curr_inode->num, offset, 0, -ENOTDIR);
         return -ENOTDIR;
     }
-    struct wfs_inode_and_child parent;
-    if(get_parent_inode(path, &parent, 0) == -1) {
-        return -ENOENT;
+    struct stat stbuf;
+    long entries = 0;
+    struct dir_listing own = { NULL, 0 };
+    inode_rdlock(curr_inode);
+    struct dir_listing *listing = dir_listing_begin(fi, &own, curr_inode, offset);
+    if (listing == NULL) {
+        inode_unlock(curr_inode);
+        TRACE_END(TRACE_READDIR, curr_inode->num, offset, 0, -ENOMEM);
+        return -ENOMEM;
     }
-    //set_bitmap(curr_inode, curr_inode->num, 0);
-    curr_inode = parent.inode;
-    char *curr_name = parent.child;
-    struct wfs_dentry *curr_dentry;
-    for(int i = 0; i < 7; ++i) {
-        if (curr_inode->blocks[i] == 0) {
-            continue;
-        }
-        curr_dentry = (struct wfs_dentry *) ((int)(curr_inode->blocks[i]) + image);
-        for(int k = 0; k < 16; ++k) { 
-            if (curr_dentry->num == -1) {
-                curr_dentry++;
-                continue;
-            }
-            if (strcmp(curr_dentry->name, curr_name) == 0) {
-                curr_inode->size -= sizeof(struct wfs_dentry);
-                curr_inode->mtim = time(NULL);
-                curr_inode->ctim = time(NULL);
-                curr_inode->atim = time(NULL);
-                curr_inode->nlinks--;
-                struct wfs_inode* inode = (struct wfs_inode*)((char *)(image + super->i_blocks_ptr) + curr_dentry->num*512);
-                for(int j = 0; j < 7; ++j) {
-                    if(inode->blocks[j] != 0) {
-                        set_bitmap((int *)(image + super->d_bitmap_ptr), (inode->blocks[j] - super->d_blocks_ptr) / 512, 0);
-                    }
-                }
-                set_bitmap((int *)(image + super->i_bitmap_ptr), curr_dentry->num, 0);
-                curr_dentry->num = -1;
-                printf("inode count is %ld\n", inode_count(image));
-                return 0;
-            }
-            curr_dentry++;
+    int num;
+    const char *name;
+    for(long pos = offset; (name = dir_entry_at(listing, pos, &num)) != NULL; ++pos) {
+        dir_entry_stat(curr_inode, pos, num, &stbuf);
+        if (filler(buf, name, &stbuf, pos + 1) != 0) { //the reply is full, the kernel comes back with pos
+            break;
         }
+        ++entries;
     }
-    printf("inode count is %ld\n", inode_count(image));
+    dir_listing_end(fi, &own);
+    inode_unlock(curr_inode);
+    TRACE_END(TRACE_READDIR, curr_inode->num, offset, entries, 0);
     return 0;
 }
 
-int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
-    printf("Calling mknod\n");
-    char *copy_path = strdup(path);
-    struct wfs_inode *inode = find_inode(copy_path); //tries to find inode
-    if (inode != NULL) { //if not null, it already exists
-        return -EEXIST;
-    }
-    struct wfs_dentry *curr_dentry;
-    struct wfs_inode_and_child parent;
-    if (get_parent_inode(path, &parent, 1) == -1) {
-        return -ENOENT;
+int dir_grow(struct wfs_inode *dir) { //doubles the hash table, returns 0 or -1 if the disk is full
+    long blocks = dir->dir_blocks ? 2L * dir->dir_blocks : 1;
+    if (blocks > max_file_blocks()) {
+        return -1;
     }
-    struct wfs_inode *curr_inode = parent.inode;//inode of the parent
-    char *curr_name = parent.child;//name of the child
-    struct wfs_dentry* free_dentry = NULL;
-    int used_blocks = 0;
-    for(int i = 0; i < 7; ++i) { //going through each data block to find a new entry and to see if there exists and inode with the same name
-        if (curr_inode->blocks[i] == 0) {//if 0, not yet allocated
-            continue;
+    struct wfs_inode table = *dir; //the new table is built on a scratch inode, then swapped in
+    memset(table.blocks, 0, sizeof(table.blocks));
+    table.dir_blocks = blocks;
+    table.used_blocks = 0;
+    for(long i = 0; i < blocks; ++i) {
+        off_t *slot = block_slot(&table, i, 1);
+        off_t address = slot == NULL ? 0 : alloc_data_block();
+        if (address == 0) {
+            free_inode_data(&table);
+            return -1;
         }
-        used_blocks += 1;
-        curr_dentry = (struct wfs_dentry *) ((int)curr_inode->blocks[i] + image);//block is being used, going to check all directory entries
-        for(int k = 0; k < 16; ++k) {
-            // printf("k is %d\n", k);
-            if (curr_dentry->num == -1) {
-                if(free_dentry == NULL) { //found a free entry, let's use it later
-                    free_dentry = curr_dentry;
-                }
-                curr_dentry++;//just a free entry, continue
-                continue;
+        *slot = address;
+        journal_dirty(slot, sizeof(off_t));
+        clear_block(image + address, 0);
+        table.used_blocks++;
+    }
+    for(long i = 0; i < dir->dir_blocks; ++i) { //rehash
+        struct wfs_dentry *entry = (struct wfs_dentry *)(image + block_pointer(dir, i));
+        for(int k = 0; k < dentries_per_block; ++k) {
+            if (entry[k].num != -1) {
+                *dir_slot(&table, dir_probe(&table, entry[k].name)) = entry[k];
             }
-            curr_dentry++;//just continue
         }
     }
-    struct wfs_inode* new_inode = get_new_inode_block(); //gets a new inode for the new file
-    if(new_inode == NULL) {
-        printf("AND HERE\n");
-        return -ENOSPC; //no more free inodes
+    free_inode_data(dir);
+    memcpy(dir->blocks, table.blocks, sizeof(dir->blocks));
+    dir->dir_blocks = blocks;
+    dir->used_blocks = table.used_blocks;
+    inode_dirty(dir);
+    TRACE_EVENT(TRACE_DIR_GROW, dir->num, 0, blocks, 0);
+    return 0;
+}
+struct wfs_dentry *dir_add_entry(struct wfs_inode *dir, const char *name, int num) { //caller holds dir's write lock and checked that name is missing
+    long entries = dir->size / sizeof(struct wfs_dentry);
+    if ((entries + 1) * 4 > dir_slots(dir) * 3 && dir_grow(dir) != 0) {
+        return NULL;
     }
-    struct wfs_dentry* entry;
-    if(free_dentry == NULL) {//No free entry, needs more blocks
-        if(used_blocks > 7) { //directory has no blocks left to allocate
-            printf("OR HERE\n");
-            return -ENOSPC;
+    struct wfs_dentry *free_dentry = dir_slot(dir, dir_probe(dir, name));
+    dir->mtim = time(NULL);
+    dir->ctim = time(NULL); //updating the time
+    dir->atim = time(NULL);
+    dir->size += sizeof(struct wfs_dentry);//updating the size of the directory
+    strcpy((char*)free_dentry->name, name);//copying the name to the directory entry
+    free_dentry->num = num;//copying the num to the directory entry
+    journal_dirty(free_dentry, sizeof(struct wfs_dentry));
+    inode_dirty(dir);
+    dcache_insert(dir->num, name, num); //replaces the negative entry left by the existence check
+    return free_dentry;
+}
+void dir_remove_entry(struct wfs_inode *dir, const char *name) { //caller holds dir's write lock and found name in it
+    long mask = dir_slots(dir) - 1;
+    long hole = dir_probe(dir, name);
+    for(long next = (hole + 1) & mask; ; next = (next + 1) & mask) {
+        struct wfs_dentry *entry = dir_slot(dir, next);
+        if (entry->num == -1) {
+            break;
         }
-        long returned = get_new_data_block(curr_inode);
-        if (returned ==  -1) {//no more free blocks in the system
-            printf("SHOULD NOT BE HERE\n");
-            return -ENOSPC;
+        long home = dir_hash(entry->name) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) { //its probe passes the hole, so it moves back into it
+            *dir_slot(dir, hole) = *entry;
+            journal_dirty(dir_slot(dir, hole), sizeof(struct wfs_dentry));
+            hole = next;
         }
-        clear_block(image + curr_inode->blocks[returned], 0);//making all entries empty
-        entry = (struct wfs_dentry*) (image + curr_inode->blocks[returned]);//setting the entry that will be filled with new directory
-    } else {
-        entry = free_dentry;// there is a free entry, so we will use it
-    }
-    curr_inode->mtim = time(NULL);
-    curr_inode->ctim = time(NULL); //updating the time
-    curr_inode->atim = time(NULL);
-    curr_inode->size += sizeof(struct wfs_dentry);//updating the size of the directory
-    strcpy((char*)entry->name, curr_name);//copying the name to the directory entry
-    entry->num = new_inode->num;//copying the num to the directory entry
-    new_inode->uid = getuid();
-    new_inode->gid = getgid();
-    new_inode->mode = mode;
-    new_inode->nlinks = 1;
-    new_inode->mtim = time(NULL);
-    new_inode->ctim = time(NULL);
-    new_inode->atim = time(NULL);
-    new_inode->size = 0;//size is 0
-    for(int j = 0; j < 8; ++j) {
-        new_inode->blocks[j] = 0; //clearing the data blocks
-    }
-    return 0;
-}
-
-int wfs_unlink(const char *path) {
-    printf("Calling unlink\n");
-    char *copy_path = strdup(path);
-    struct wfs_inode *inode = find_inode(copy_path);
-    if (inode == NULL) {
-        return -ENOENT;
     }
-    if (S_ISDIR(inode->mode)) {
-        return -EISDIR;
+    dir_slot(dir, hole)->num = -1;
+    journal_dirty(dir_slot(dir, hole), sizeof(struct wfs_dentry));
+    dir->mtim = time(NULL);
+    dir->ctim = time(NULL);
+    dir->atim = time(NULL);
+    dir->size -= sizeof(struct wfs_dentry);
+    if (dir->size == 0) { //an empty directory gives its table back
+        free_inode_data(dir);
+        dir->dir_blocks = 0;
     }
-    struct wfs_inode_and_child parent;
-    if (get_parent_inode(path, &parent, 0) == -1) {
-        return -ENOENT;
+    inode_dirty(dir);
+    dcache_insert(dir->num, name, -1);
+}
+int uses_extents(struct wfs_inode *inode) {
+    return (super->features & WFS_FEATURE_EXTENTS) && S_ISREG(inode->mode);
+}
+/*
+  Returns the blocks[] or indirect-block slot that holds the address of
+  logical block lblk, walking at most three levels of indirection. With alloc,
+  missing indirect blocks on the way are allocated and zeroed. NULL if lblk is
+  past the triple-indirect range or an indirect block is missing.
+*/
+off_t *block_slot(struct wfs_inode *inode, long lblk, int alloc) {
+    if (lblk <= D_BLOCK) {
+        return &inode->blocks[lblk];
     }
-    struct wfs_inode *curr_inode = parent.inode;
-    char *curr_name = parent.child;
-    printf("curr_name in unlink is %s curr_inode->num is %d\n", curr_name, curr_inode->num);
-    struct wfs_dentry *curr_dentry;
-    for(int i = 0; i < 7; ++i) {
-        if (curr_inode->blocks[i] == 0) {
-            // printf("curr_inode->blocks[%d] is 0\n", i);
-            continue;
+    lblk -= IND_BLOCK;
+    long span = ptrs_per_block; //logical blocks covered by one pointer at the top level
+    int level = IND_BLOCK;
+    while (lblk >= span) {
+        lblk -= span;
+        ++level;
+        if (level > TIND_BLOCK) {
+            return NULL;
         }
-        curr_dentry = (struct wfs_dentry *) ((int)(curr_inode->blocks[i]) + image);
-        for(int k = 0; k < 16; ++k) {
-            // printf("curr_dentry->num is %d curr_dentry->name is %s\n", curr_dentry->num, curr_dentry->name);
-            // printf("curr_inode->num is %d\n", curr_inode->num);
-            if (curr_dentry->num == -1) {
-                curr_dentry++;
-                continue;
+        span *= ptrs_per_block;
+    }
+    off_t *slot = &inode->blocks[level];
+    for(int depth = level - D_BLOCK; depth > 0; --depth) {
+        if (*slot == 0) {
+            if (!alloc) {
+                return NULL;
             }
-            if (strcmp(curr_dentry->name, curr_name) == 0) {
-                // printf("FOUND INODE IN UNLINK\n");
-                for (int j = 0; j < 8; ++j) {
-                    if (inode->blocks[j] != 0) {
-                        if (j == 7) {
-                            long* pointer = (long*)(image + inode->blocks[7]);
-                            while(*pointer != 0) {
-                                set_bitmap((int*)(image + super->d_bitmap_ptr), *(pointer - super->d_blocks_ptr) / 512, 0);
-                                ++pointer;
-                            }
-                        } else {
-                            set_bitmap((int *)(image + super->d_bitmap_ptr), (inode->blocks[j] - super->d_blocks_ptr) / 512, 0);
-                        }
-                        // printf("inode->blocks[%d] is %lx\n", j, inode->blocks[j]);
-                    }
-                }
-                curr_inode->size -= sizeof(struct wfs_dentry);
-                // shift_dentries(curr_inode, i, k);
-                // if(curr_inode->size % 512 == 0) {
-                //     set_bitmap((int*)(image + super->d_bitmap_ptr), (curr_inode->blocks[curr_inode->size / 512] - super->d_blocks_ptr) / 512, 0);
-                // }
-                curr_inode->mtim = time(NULL);
-                curr_inode->ctim = time(NULL);
-                curr_inode->atim = time(NULL);
-                set_bitmap((int *)(image + super->i_bitmap_ptr), curr_dentry->num, 0);
-                curr_dentry->num = -1;
-                return 0;
+            *slot = alloc_data_block();
+            if (*slot == 0) {
+                return NULL;
             }
-            curr_dentry++;
+            journal_dirty(slot, sizeof(off_t));
+            clear_block(image + *slot, 1);
+            inode->used_blocks++;
         }
+        span /= ptrs_per_block;
+        slot = ((off_t*)(image + *slot)) + lblk / span;
+        lblk %= span;
     }
-
-    return 0;
+    return slot;
 }
-
-int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("Calling read\n");
-    struct wfs_inode *curr_inode = find_inode(path);
-    if(curr_inode == NULL) {
-        return -ENOENT;
-    }
-    // if(!S_ISREG(curr_inode->mode)) {
-    //     return -EISDIR;
-    // }
-    int block_number = offset / 512; //this will tell us where to start the reads
-    char* pointer;
-    long* address_pointer_offset = NULL;
-    int indirect_index = -1;
-    int bytes_read = 0;
-    if(block_number > 6) { //if block number is less than 6, setting the initial pointer to the block. If greater, setting it according to indirect block
-        indirect_index = block_number - 7;
-        address_pointer_offset = ((long*)(image + curr_inode->blocks[7])) + indirect_index;
-        pointer = image + *address_pointer_offset;
-    } else {
-        pointer = image + curr_inode->blocks[block_number];
-    }
-    int first_block_offset = offset % 512;
-    int bytes_left = size;
-    int bytes_that_can_be_read = curr_inode->size - offset;
-    int first_read = 1;
-    long quantity;
-    if (curr_inode->size - offset < size) {
-        bytes_left = curr_inode->size - offset;
+off_t block_pointer(struct wfs_inode *inode, long lblk) { //block-pointer mapping of logical block lblk, 0 if unmapped
+    off_t *slot = block_slot(inode, lblk, 0);
+    return slot == NULL ? 0 : *slot;
+}
+long max_file_blocks() { //largest logical block count the block pointers can map
+    return IND_BLOCK + ptrs_per_block + (long)ptrs_per_block * ptrs_per_block + (long)ptrs_per_block * ptrs_per_block * ptrs_per_block;
+}
+/*
+  Walks a file's extent list in logical order, following link slots into
+  extent blocks and skipping the unused slots an array may leave before its
+  link. Starts with it.slot == NULL; each call moves to the next slot and
+  returns it, or NULL once the last array is exhausted. it.block is the
+  extent block holding slot, -1 while in the inode.
+*/
+struct extent_iter {
+    struct wfs_extent *slot;
+    int left;   //slots left in the current array, including slot
+    long block;
+};
+struct wfs_extent *extent_next(struct wfs_inode *inode, struct extent_iter *it) {
+    if (it->slot == NULL) {
+        it->slot = inode->extents;
+        it->left = N_EXTENTS;
+        it->block = -1;
     } else {
-        bytes_left = size;
-    }    while(bytes_left != 0) {
-        if(block_number >= 7) { //if we reach block 7, we need to go to the next loop for the indirect blocks
-            break;
+        ++it->slot;
+        --it->left;
+        if (it->left == 0) {
+            return NULL;
         }
-        if(first_read) { //first read, need to consider offset
-            if(bytes_left < 512 - first_block_offset) {
-                quantity = bytes_left;
-            } else {
-                quantity = 512 - first_block_offset;
+    }
+    struct wfs_extent *link = it->slot + it->left - 1;
+    while (link->len == WFS_EXTENT_LINK && (it->slot == link || it->slot->len == 0)) {
+        it->block = link->start;
+        it->slot = (struct wfs_extent *)(image + block_address(link->start));
+        it->left = extents_per_block;
+        link = it->slot + it->left - 1;
+    }
+    return it->slot;
+}
+struct wfs_extent *extent_array(struct wfs_inode *inode, const struct extent_iter *it, int *cap) { //the array holding it.slot, and its slot count
+    *cap = it->block == -1 ? N_EXTENTS : extents_per_block;
+    return it->block == -1 ? inode->extents : (struct wfs_extent *)(image + block_address(it->block));
+}
+/*
+  Returns the byte offset of logical block lblk, 0 if it is not mapped. *run is
+  set to how many blocks starting at lblk are physically contiguous, capped at
+  max_run, so callers can copy a whole run with one memcpy. Extent files answer
+  straight from the extent list; block-pointer files coalesce adjacent pointers.
+  For a hole, *run is how many blocks from lblk are unmapped (up to max_run):
+  holes in block-pointer files are missing pointers, in extent files hole
+  extents and everything past the last extent.
+*/
+off_t map_block(struct wfs_inode *inode, long lblk, long *run, long max_run) {
+    *run = 1;
+    if (uses_extents(inode)) {
+        long first = 0; //logical block where extent starts
+        struct extent_iter it = { NULL, 0, -1 };
+        struct wfs_extent *extent;
+        while ((extent = extent_next(inode, &it)) != NULL && extent->len != 0) {
+            if (lblk < first + extent->len) {
+                long into = lblk - first;
+                *run = extent->len - into < max_run ? extent->len - into : max_run;
+                return extent->start == WFS_EXTENT_HOLE ? 0 : block_address(extent->start + into);
             }
-            pointer += first_block_offset;
-            memcpy(buf, pointer, quantity);
-            bytes_left = bytes_left - quantity;
-            buf = buf + quantity;
-            block_number++;
-            pointer = image + curr_inode->blocks[block_number];
-            bytes_read = bytes_read + quantity;
-            first_read = 0;
-            continue;
+            first += extent->len;
         }
-        if (bytes_left >= 512) { //subsequent read, can copy whole 512 bytes because first read guarantees it
-            memcpy(buf, pointer, 512);
-            bytes_left -= 512;
-            buf += 512;
-            block_number++;
-            pointer = image + curr_inode->blocks[block_number];
-            bytes_read += 512;
-        } else { //last read if we don't need to get into the indirect block
-            memcpy(buf, pointer, bytes_left);
-            bytes_read += bytes_left;
-            bytes_left = 0;
-        }
-    }
-    if(address_pointer_offset == NULL) {//first time using indirect block, need to set the pointer accordingly. 
-    //If offset makes us write here first, pointer already set in one of the first ifs
-        indirect_index = 0;
-        address_pointer_offset = (long*)(image + curr_inode->blocks[7]);
-        pointer = image + *address_pointer_offset;
-    }
-    while(bytes_left != 0) {
-        if(indirect_index == 64) { //finished all indirect nodes
-            printf("In wfs_read, no more indirect indexes\n");
-            break;
+        *run = max_run;
+        return 0;
+    }
+    off_t address = block_pointer(inode, lblk);
+    if (address == 0) {
+        while (*run < max_run && block_pointer(inode, lblk + *run) == 0) {
+            ++*run;
         }
-        if(bytes_that_can_be_read == 0) {
-            break;
+        return 0;
+    }
+    while (*run < max_run && block_pointer(inode, lblk + *run) == address + block_size * *run) {
+        ++*run;
+    }
+    return address;
+}
+/*
+  Growing a file. Blocks are allocated as runs of up to the whole growth at
+  once, starting right after the file's last block when it is free. New
+  blocks read as zeros, except logical blocks [keep_first, keep_end), which
+  the caller is about to overwrite completely (pass 0, 0 to zero everything).
+  A hole below the size is zeroed whole even there, so a write that fails
+  part way never shows what the block held before. Both mappings map only
+  the range asked for and leave holes elsewhere: extent files split the
+  hole extents it overlaps, and a gap past their last extent becomes a
+  hole extent.
+*/
+void zero_new_run(off_t address, long lblk, long count, long keep_first, long keep_end) { //zeroes what the caller won't overwrite of a new run at lblk
+    long lo = lblk > keep_first ? lblk : keep_first;
+    long hi = lblk + count < keep_end ? lblk + count : keep_end;
+    if (lo >= hi) {
+        zero_blocks(address, count);
+        return;
+    }
+    if (lo > lblk) {
+        zero_blocks(address, lo - lblk);
+    }
+    if (hi < lblk + count) {
+        zero_blocks(address + (hi - lblk) * block_size, lblk + count - hi);
+    }
+}
+void zero_file_blocks(struct wfs_inode *inode, long first, long end) { //zeroes mapped logical blocks [first, end), for a write that failed after skipping their zeroing
+    while (first < end) {
+        long run;
+        off_t address = map_block(inode, first, &run, end - first);
+        if (address != 0) {
+            zero_blocks(address, run);
         }
-        if (first_read) { // we may be doing the first read form here, so need to take offset into account
-            if(bytes_left < 512 - first_block_offset) {
-                quantity = bytes_left;
-            } else {
-                quantity = 512 - first_block_offset;
+        first += run;
+    }
+}
+/*
+  Editing the middle of an extent list. extent_replace swaps the slot an
+  iterator is at for n extents, none to remove it. They go into the slot's
+  own array when it has room; otherwise the array keeps what comes before
+  the slot and links to new extent blocks holding the replacement and the
+  rest of the array, so an edit touches one array however long the list is.
+  The iterator is stale afterwards. Returns 0, or -ENOSPC with nothing
+  changed.
+*/
+long extent_chain(struct wfs_inode *inode, const struct wfs_extent *entries, int count, const struct wfs_extent *link) { //lays entries out in new extent blocks ending in link, if any; returns the first block or -1
+    int per = extents_per_block - 1; //entries in a block that links on
+    int nblocks = 1;
+    for(int rest = count; rest > per && (link != NULL || rest > extents_per_block); rest -= per) {
+        ++nblocks;
+    }
+    long *blocks = malloc(nblocks * sizeof(long));
+    if (blocks == NULL) {
+        return -1;
+    }
+    for(int b = 0; b < nblocks; ++b) {
+        long got;
+        blocks[b] = alloc_data_run(b > 0 ? blocks[b - 1] + 1 : -1, 1, &got);
+        if (blocks[b] == -1) {
+            while (b-- > 0) {
+                free_data_run(blocks[b], 1);
             }
-            pointer += first_block_offset;
-            memcpy(buf, pointer, quantity);
-            bytes_left = bytes_left - quantity;
-            buf = buf + quantity;
-            ++address_pointer_offset;
-            pointer = image + *address_pointer_offset;
-            first_read = 0;
-            bytes_read = bytes_read + quantity;
-            continue;
+            free(blocks);
+            return -1;
         }
-        if(bytes_left >= 512) { //guaranteed to be 512 bytes long
-            memcpy(buf, pointer, 512);
-            bytes_left -= 512;
-            buf += 512;
-            ++address_pointer_offset;
-            pointer = image + *address_pointer_offset;
-            bytes_read += 512;
-        } else { //last read
-            memcpy(buf, pointer, bytes_left);
-            bytes_read += bytes_left;
-            bytes_left = 0;
+    }
+    for(int b = 0; b < nblocks; ++b) {
+        struct wfs_extent *array = (struct wfs_extent *)(image + block_address(blocks[b]));
+        int k = b + 1 < nblocks ? per : count;
+        memset(array, 0, block_size);
+        memcpy(array, entries, k * sizeof(*entries));
+        entries += k;
+        count -= k;
+        if (b + 1 < nblocks) {
+            array[per].start = blocks[b + 1];
+            array[per].len = WFS_EXTENT_LINK;
+        } else if (link != NULL) {
+            array[per] = *link;
         }
-        ++indirect_index;
+        journal_dirty(array, block_size);
     }
-    return bytes_read;
+    inode->used_blocks += nblocks;
+    long first = blocks[0];
+    free(blocks);
+    return first;
 }
-
-int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("Calling write with size %ld\n", size);
-    struct wfs_inode *curr_inode = find_inode(path);
-    if(curr_inode == NULL) {
+int extent_replace(struct wfs_inode *inode, struct extent_iter *it, const struct wfs_extent *with, int n) {
+    int cap;
+    struct wfs_extent *array = extent_array(inode, it, &cap);
+    int at = cap - it->left;
+    int links = array[cap - 1].len == WFS_EXTENT_LINK;
+    int room = links ? cap - 1 : cap; //slots that can hold extents
+    int used = at + 1;                //slots in use, up to the first unused one
+    while (used < room && array[used].len != 0) {
+        ++used;
+    }
+    if (used - 1 + n <= room) {
+        int end = used - 1 + n;
+        memmove(&array[at + n], &array[at + 1], (used - at - 1) * sizeof(*array));
+        if (n > 0) {
+            memcpy(&array[at], with, n * sizeof(*array));
+        }
+        if (end < used) {
+            memset(&array[end], 0, (used - end) * sizeof(*array));
+        }
+        journal_dirty(&array[at], ((end > used ? end : used) - at) * sizeof(*array));
+        return 0;
+    }
+    int count = n + used - at - 1;
+    struct wfs_extent *moved = malloc(count * sizeof(*moved));
+    if (moved == NULL) {
+        return -ENOSPC;
+    }
+    memcpy(moved, with, n * sizeof(*moved));
+    memcpy(moved + n, &array[at + 1], (used - at - 1) * sizeof(*moved));
+    long first = extent_chain(inode, moved, count, links ? &array[cap - 1] : NULL);
+    free(moved);
+    if (first == -1) {
+        return -ENOSPC;
+    }
+    memset(&array[at], 0, (cap - at) * sizeof(*array));
+    array[cap - 1].start = first;
+    array[cap - 1].len = WFS_EXTENT_LINK;
+    journal_dirty(&array[at], (cap - at) * sizeof(*array));
+    return 0;
+}
+void extent_tidy(struct wfs_inode *inode) { //merges adjacent holes and drops a trailing one
+    for(;;) {
+        struct extent_iter it = { NULL, 0, -1 };
+        struct extent_iter prev_it;
+        struct wfs_extent *prev = NULL;
+        struct wfs_extent *slot;
+        while ((slot = extent_next(inode, &it)) != NULL && slot->len != 0) {
+            if (prev != NULL && prev->start == WFS_EXTENT_HOLE && slot->start == WFS_EXTENT_HOLE && prev->len <= INT_MAX - slot->len) {
+                break;
+            }
+            prev = slot;
+            prev_it = it;
+        }
+        if (slot != NULL && slot->len != 0) {
+            prev->len += slot->len;
+            journal_dirty(prev, sizeof(*prev));
+            extent_replace(inode, &it, NULL, 0); //a removal always fits
+        } else if (prev != NULL && prev->start == WFS_EXTENT_HOLE) {
+            extent_replace(inode, &prev_it, NULL, 0);
+        } else {
+            return;
+        }
+    }
+}
+long free_extent_blocks(const struct wfs_extent *link) { //frees the extent blocks chained from link, if it is a link slot; returns how many
+    long freed = 0;
+    long block = link->len == WFS_EXTENT_LINK ? link->start : -1;
+    while (block != -1) {
+        link = (struct wfs_extent *)(image + block_address(block)) + extents_per_block - 1;
+        long next = link->len == WFS_EXTENT_LINK ? link->start : -1; //read before the block goes
+        free_data_run(block, 1);
+        ++freed;
+        block = next;
+    }
+    return freed;
+}
+#define FILL_RUNS 16 // runs one fill_hole call maps at most
+int fill_hole(struct wfs_inode *inode, struct extent_iter *it, struct wfs_extent *prev, long at, long lo, long hi, long keep_first, long keep_end) { //maps logical blocks [lo, hi) of the hole extent at it, which starts at at; prev is the data extent before it, if any
+    long len = it->slot->len;
+    long hint = prev != NULL ? prev->start + prev->len : -1;
+    if (hi > at + len) {
+        hi = at + len;
+    }
+    struct wfs_extent with[FILL_RUNS + 2];
+    int n = 0;
+    if (lo > at) {
+        with[n++] = (struct wfs_extent){ WFS_EXTENT_HOLE, (int)(lo - at) };
+    }
+    long mapped = lo;
+    int rc = 0;
+    while (mapped < hi && n < FILL_RUNS + 1) {
+        long got;
+        long start = alloc_data_run(hint, hi - mapped, &got);
+        if (start == -1) {
+            rc = -ENOSPC;
+            break;
+        }
+        with[n++] = (struct wfs_extent){ (int)start, (int)got };
+        mapped += got;
+        hint = start + got;
+    }
+    if (mapped == lo) {
+        return rc;
+    }
+    if (mapped < at + len) {
+        with[n++] = (struct wfs_extent){ WFS_EXTENT_HOLE, (int)(at + len - mapped) };
+    }
+    int merge = prev != NULL && lo == at && with[0].start == prev->start + prev->len && prev->len <= INT_MAX - with[0].len; //the first run continues prev
+    int replaced = extent_replace(inode, it, with + merge, n - merge);
+    if (replaced == 0 && merge) {
+        prev->len += with[0].len;
+        journal_dirty(prev, sizeof(*prev));
+    }
+    for(int i = 0; i < n; ++i) {
+        if (with[i].start != WFS_EXTENT_HOLE) {
+            if (replaced != 0) {
+                free_data_run(with[i].start, with[i].len);
+            } else {
+                inode->used_blocks += with[i].len;
+                zero_new_run(block_address(with[i].start), at, with[i].len, keep_first, keep_end);
+            }
+        }
+        at += with[i].len;
+    }
+    return replaced != 0 ? replaced : rc;
+}
+int extent_append(struct wfs_inode *inode, struct extent_iter *it, struct wfs_extent **slot, struct wfs_extent **last, long start, long len) { //adds an extent after *last; *slot is the first unused slot, NULL if the last array is full
+    struct wfs_extent *l = *last;
+    if (l != NULL && l->len <= INT_MAX - len && (start == WFS_EXTENT_HOLE ? l->start == WFS_EXTENT_HOLE : l->start != WFS_EXTENT_HOLE && start == l->start + l->len)) {
+        l->len += len;
+        journal_dirty(l, sizeof(*l));
+        return 0;
+    }
+    if (*slot == NULL) { //move the array's last extent into a new extent block and link to it
+        long link_got;
+        long link = alloc_data_run(start != WFS_EXTENT_HOLE ? start + len : -1, 1, &link_got);
+        if (link == -1) {
+            return -ENOSPC;
+        }
+        inode->used_blocks++;
+        struct wfs_extent *block = (struct wfs_extent *)(image + block_address(link));
+        memset(block, 0, block_size);
+        journal_dirty(block, block_size);
+        block[0] = *l;
+        l->start = link;
+        l->len = WFS_EXTENT_LINK;
+        journal_dirty(l, sizeof(*l));
+        it->slot = *slot = &block[1];
+        it->left = extents_per_block - 1;
+        it->block = link;
+    }
+    (*slot)->start = start;
+    (*slot)->len = len;
+    journal_dirty(*slot, sizeof(**slot));
+    *last = *slot;
+    *slot = extent_next(inode, it);
+    return 0;
+}
+int grow_extents(struct wfs_inode *inode, long first, long nblocks, long keep_first, long keep_end) {
+    for(;;) { //fill the hole extents [first, nblocks) overlaps
+        long at = 0;
+        struct extent_iter it = { NULL, 0, -1 };
+        struct wfs_extent *prev = NULL;
+        struct wfs_extent *slot;
+        while ((slot = extent_next(inode, &it)) != NULL && slot->len != 0) {
+            if (slot->start == WFS_EXTENT_HOLE && at < nblocks && at + slot->len > first) {
+                break;
+            }
+            prev = slot->start != WFS_EXTENT_HOLE ? slot : NULL;
+            at += slot->len;
+        }
+        if (slot == NULL || slot->len == 0) {
+            break;
+        }
+        int rc = fill_hole(inode, &it, prev, at, first > at ? first : at, nblocks, keep_first, keep_end);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    long mapped = 0;
+    struct extent_iter it = { NULL, 0, -1 };
+    struct wfs_extent *last = NULL;
+    struct wfs_extent *slot;
+    while ((slot = extent_next(inode, &it)) != NULL && slot->len != 0) {
+        mapped += slot->len;
+        last = slot;
+    }
+    // slot is now the first unused slot, or NULL if the last array is full
+    while (mapped < nblocks) {
+        long from = mapped > first ? mapped : first;
+        long got;
+        long start = alloc_data_run(last != NULL && last->start != WFS_EXTENT_HOLE ? last->start + last->len : -1, nblocks - from, &got); //try to continue the last extent first
+        if (start == -1) {
+            return -ENOSPC;
+        }
+        int rc = 0;
+        while (rc == 0 && mapped < from) { //the gap before the range becomes a hole
+            long gap = from - mapped < INT_MAX ? from - mapped : INT_MAX;
+            rc = extent_append(inode, &it, &slot, &last, WFS_EXTENT_HOLE, gap);
+            mapped += rc == 0 ? gap : 0;
+        }
+        if (rc == 0) {
+            rc = extent_append(inode, &it, &slot, &last, start, got);
+        }
+        if (rc != 0) {
+            free_data_run(start, got);
+            extent_tidy(inode); //a hole may have gone in without the run after it
+            return rc;
+        }
+        inode->used_blocks += got;
+        zero_new_run(block_address(start), mapped, got, keep_first, keep_end);
+        mapped += got;
+    }
+    return 0;
+}
+int grow_file(struct wfs_inode *inode, long first, long nblocks, long keep_first, long keep_end) { //makes sure logical blocks [first, nblocks) are mapped, see above
+    long old_end = (inode->size + block_size - 1) / block_size;
+    if (keep_first < old_end) {
+        keep_first = old_end;
+    }
+    if (uses_extents(inode)) {
+        return grow_extents(inode, first, nblocks, keep_first, keep_end);
+    }
+    if (nblocks > max_file_blocks()) {
+        return -EFBIG;
+    }
+    long lblk = first;
+    off_t before = lblk > 0 ? block_pointer(inode, lblk - 1) : 0;
+    long hint = before != 0 ? block_index(before) + 1 : -1;
+    while (lblk < nblocks) {
+        off_t *slot = block_slot(inode, lblk, 1);
+        if (slot == NULL) {
+            return -ENOSPC; //no room for an indirect block
+        }
+        if (*slot != 0) { //preallocated, or left behind by a write that ran out of space
+            hint = block_index(*slot) + 1;
+            ++lblk;
+            continue;
+        }
+        long got;
+        long start = alloc_data_run(hint, nblocks - lblk, &got);
+        if (start == -1) {
+            return -ENOSPC; //didn't find a new data block, because it is out of space
+        }
+        long used = 0;
+        for(; used < got; ++used) { //indirect blocks met on the way come from after the run
+            slot = block_slot(inode, lblk + used, 1);
+            if (slot == NULL || *slot != 0) {
+                break;
+            }
+            *slot = block_address(start + used);
+            journal_dirty(slot, sizeof(off_t));
+        }
+        if (used < got) {
+            free_data_run(start + used, got - used);
+        }
+        inode->used_blocks += used;
+        zero_new_run(block_address(start), lblk, used, keep_first, keep_end);
+        lblk += used;
+        hint = start + used;
+    }
+    return 0;
+}
+long free_block_tree(off_t address, int depth) { //frees a block and, for indirect blocks, everything below it; returns the blocks freed
+    long freed = 1;
+    if (depth > 0) {
+        off_t *pointers = (off_t*)(image + address);
+        for(int i = 0; i < ptrs_per_block; ++i) {
+            if (pointers[i] != 0) {
+                freed += free_block_tree(pointers[i], depth - 1);
+            }
+        }
+    }
+    free_data_block(address);
+    return freed;
+}
+void free_inode_data(struct wfs_inode *inode) { //releases every data block of inode, caller holds its write lock
+    map_gens[inode->num]++; //handles may remember some of these blocks
+    inode->used_blocks = 0;
+    if (uses_extents(inode)) {
+        struct extent_iter it = { NULL, 0, -1 };
+        struct wfs_extent *slot;
+        while ((slot = extent_next(inode, &it)) != NULL && slot->len != 0) {
+            if (slot->start != WFS_EXTENT_HOLE) {
+                free_data_run(slot->start, slot->len);
+            }
+        }
+        free_extent_blocks(&inode->extents[N_EXTENTS - 1]);
+        memset(inode->extents, 0, sizeof(inode->extents));
+        return;
+    }
+    for (int j = 0; j < N_BLOCKS; ++j) {
+        if (inode->blocks[j] != 0) {
+            free_block_tree(inode->blocks[j], j <= D_BLOCK ? 0 : j - D_BLOCK);
+            inode->blocks[j] = 0;
+        }
+    }
+}
+/*
+  Inode lifetime. Removing an inode's last name only drops the dentry and
+  nlinks; the inode and its data stay until nothing refers to it. The
+  low-level frontend counts every entry reply the kernel has not forgotten
+  in nlookups, and open handles are counted in open_counts, so I/O through
+  an open file keeps working after unlink, and the number is not handed
+  out again while the kernel can still send it. The counts go up under at
+  least the inode's read lock and down under its write lock, and whoever
+  leaves the inode with no links and no references frees it. An inode
+  still referenced at unmount or at a crash stays allocated with nlinks 0,
+  an orphan, and release_orphans frees it at unmount or at the next mount.
+*/
+void inode_release(struct wfs_inode *inode) { //frees inode if nothing refers to it any more; caller holds its write lock inside journal_begin, and no other inode lock
+    if (inode->nlinks > 0 || nlookups[inode->num] > 0 || open_counts[inode->num] > 0) {
+        return;
+    }
+    while (S_ISREG(inode->mode) && truncate_step(inode, 0) > 0) { //a large file goes a step at a time, see inode_step
+        inode_dirty(inode);
+        inode_step(inode);
+    }
+    free_inode_data(inode);
+    inode_dirty(inode);
+    writeback_forget(inode->num);
+    free_inode_block(inode->num); //only after the dentry is gone, so the number can't be handed out while reachable
+}
+void inode_get(unsigned long *refs, struct wfs_inode *inode) { //one more reference, caller holds at least inode's read lock
+    __atomic_fetch_add(&refs[inode->num], 1, __ATOMIC_RELAXED);
+}
+/*
+  Truncate, fallocate, hole punching and freeing a deleted file work in
+  steps of at most WFS_JOURNAL_STEP blocks, each its own transaction, so
+  none outgrows the log (see wfs.h). inode_step ends one step and starts
+  the next: the inode is unlocked and journal_end lets a commit run, then
+  both are taken again. The file must be consistent at every step. A
+  reference held meanwhile keeps the inode from being freed under the
+  caller, which calls inode_release once done in case the last one went
+  away. The caller holds inode's write lock inside journal_begin and no
+  other inode lock.
+*/
+void inode_step(struct wfs_inode *inode) {
+    inode_get(open_counts, inode);
+    inode_unlock(inode);
+    journal_end();
+    journal_begin();
+    inode_wrlock(inode);
+    open_counts[inode->num]--;
+}
+void inode_put(unsigned long *refs, struct wfs_inode *inode, unsigned long n) { //drops n references, freeing an unlinked inode with the last one
+    journal_begin();
+    inode_wrlock(inode);
+    refs[inode->num] -= n < refs[inode->num] ? n : refs[inode->num];
+    inode_release(inode);
+    inode_unlock(inode);
+    journal_end();
+}
+void release_orphans(int scan) { //frees unlinked inodes whose references are gone with the kernel; scan checks every inode, not just referenced ones
+    uint32_t *map = (uint32_t *)(image + super->i_bitmap_ptr);
+    for(size_t num = 1; num < super->num_inodes; ++num) {
+        if ((!scan && nlookups[num] == 0 && open_counts[num] == 0) || !bitmap_get(map, num)) {
+            continue;
+        }
+        nlookups[num] = 0;
+        open_counts[num] = 0;
+        struct wfs_inode *inode = inode_at(num);
+        journal_begin();
+        inode_wrlock(inode);
+        inode_release(inode);
+        inode_unlock(inode);
+        journal_end();
+    }
+}
+int dir_create(struct wfs_inode *curr_inode, const char *curr_name, mode_t mode, int lookup) { //shared by both frontends' mkdir and mknod, returns the new inode number or a negative errno; lookup counts the entry reply the caller will send
+    journal_begin_dir();
+    inode_wrlock(curr_inode);
+    if (curr_inode->nlinks == 0) { //removed, but still known to the kernel
+        inode_unlock(curr_inode);
+        journal_end();
+        return -ENOENT;
+    }
+    if (dir_lookup(curr_inode, curr_name) != -1) { //checked under the parent's lock so two creates can't both succeed
+        inode_unlock(curr_inode);
+        journal_end();
+        return -EEXIST;
+    }
+    struct wfs_inode* new_inode = get_new_inode_block(); //gets a new inode for the new file
+    if(new_inode == NULL) {
+        inode_unlock(curr_inode);
+        journal_end();
+        return -ENOSPC; //no more free inodes
+    }
+    // nobody can reach the new inode until its dentry exists, so it is filled without its lock
+    new_inode->uid = getuid();
+    new_inode->gid = getgid();
+    new_inode->mode = mode;
+    new_inode->nlinks = S_ISDIR(mode) ? 2 : 1; // a directory references itself and the parent also has a link to it
+    new_inode->mtim = time(NULL);
+    new_inode->ctim = time(NULL);
+    new_inode->atim = time(NULL);
+    new_inode->size = 0;//size is 0
+    for(int j = 0; j < N_BLOCKS; ++j) {
+        new_inode->blocks[j] = 0; //clearing the data blocks
+    }
+    new_inode->dir_blocks = 0;
+    new_inode->flags = S_ISREG(mode) && inline_capacity > 0 ? WFS_INODE_INLINE : 0;
+    inode_dirty(new_inode);
+    if (dir_add_entry(curr_inode, curr_name, new_inode->num) == NULL) {
+        free_inode_block(new_inode->num);
+        inode_unlock(curr_inode);
+        journal_end();
+        return -ENOSPC;
+    }
+    if (S_ISDIR(mode)) {
+        curr_inode->nlinks++; //setting new link, because we are creating a child directory
+    }
+    if (lookup) {
+        inode_get(nlookups, new_inode); //before the parent is unlocked and the new name can be removed
+    }
+    inode_unlock(curr_inode);
+    journal_end();
+    return new_inode->num;
+}
+int dir_remove(struct wfs_inode *curr_inode, const char *curr_name, int is_dir) { //shared by both frontends' rmdir and unlink
+    int rc = 0;
+    journal_begin_dir();
+    inode_wrlock(curr_inode); //parent before child
+    struct wfs_dentry *curr_dentry = dir_find(curr_inode, curr_name);
+    if (curr_dentry == NULL) {
+        inode_unlock(curr_inode);
+        journal_end();
         return -ENOENT;
     }
-    // if(!S_ISREG(curr_inode->mode)) {
-    //     return -EISDIR;
-    // }
-    long allocated_memory = (curr_inode->size + 511) & (~511); //how much memory is already alocated for this file
-    printf("allocated memory is %ld\n", allocated_memory);
-    printf("offset is %ld\n", offset);
-    long new_file_end_byte = (long)offset + size; // how much the file wants to extend its contents in memory, if any. Also is the new size
-    printf("new_file end byte is %ld\n", new_file_end_byte);
-    if(new_file_end_byte > 512 * 7 + 512 * 64) { //checks if file is not becoming too big. If it is, we allow write, but only until limit SUSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSSS
-        new_file_end_byte = 512 * 7 + 512 * 64;
-    }
-    long* address_pointer_offset = NULL;
-    long new_memory_needed = new_file_end_byte - allocated_memory;
-    long returned;
-    if(new_memory_needed > 0) { //get new memory
-        long used_blocks = 0;
-        long indirect_blocks_used = 0;
-        for(int i = 0; i < 8; ++i) {
-            if(curr_inode->blocks[i] != 0) {
-                ++used_blocks;
-            }
+    struct wfs_inode* inode = inode_at(curr_dentry->num);
+    inode_wrlock(inode);
+    if (is_dir && !S_ISDIR(inode->mode)) {
+        rc = -ENOTDIR;
+    } else if (!is_dir && S_ISDIR(inode->mode)) {
+        rc = -EISDIR;
+    } else if (is_dir && !dir_is_empty(inode)) { //children would be leaked, and their cached entries would outlive the directory
+        rc = -ENOTEMPTY;
+    }
+    if (rc != 0) {
+        inode_unlock(inode);
+        inode_unlock(curr_inode);
+        journal_end();
+        return rc;
+    }
+    inode->nlinks = 0;
+    inode->ctim = time(NULL);
+    inode_dirty(inode);
+    if (is_dir) {
+        curr_inode->nlinks--;
+    }
+    dir_remove_entry(curr_inode, curr_name);
+    inode_unlock(curr_inode); //inode_release may step, holding only the inode's lock
+    inode_release(inode); //or later, when the kernel forgets it and the last handle is released
+    inode_unlock(inode);
+    journal_end();
+    return 0;
+}
+/*
+  rename moves a dentry, never file data. The moved inode's number goes
+  into the target name's slot, rewritten in place when the name exists
+  (the inode it named is freed, like unlink) and otherwise taken where
+  mknod would put it; then the source slot is removed. Both happen in one
+  journal transaction, so after a crash exactly one of the names exists.
+  Up to four inodes are write locked: both directories, the moved inode
+  and the replaced one. A directory moved elsewhere may be the ancestor
+  of the other, which parent-before-child can't order without walking up,
+  so the locks are only tried while others are held. When one is busy,
+  everything is dropped, the busy lock is waited for and the lookup is
+  redone.
+  The replaced inode loses its link like an unlinked one, see inode_release.
+  Moving a directory below itself is refused by the kernel for both
+  frontends; wfs only checks the direct case and, by path, wfs_rename.
+*/
+int inode_listed(const int *nums, int n, int num) {
+    for(int i = 0; i < n; ++i) {
+        if (nums[i] == num) {
+            return 1;
+        }
+    }
+    return 0;
+}
+void unlock_all(const int *nums, int n) {
+    for(int i = 0; i < n; ++i) {
+        if (nums[i] != -1 && !inode_listed(nums, i, nums[i])) {
+            pthread_rwlock_unlock(&inode_locks[nums[i]]);
+        }
+    }
+}
+int trylock_all(const int *nums, int n) { //write locks the inodes in nums (-1 and repeats skipped), all or none; returns -1 or the busy inode
+    for(int i = 0; i < n; ++i) {
+        if (nums[i] == -1 || inode_listed(nums, i, nums[i])) {
+            continue;
+        }
+        if (pthread_rwlock_trywrlock(&inode_locks[nums[i]]) != 0) {
+            unlock_all(nums, i);
+            return nums[i];
+        }
+    }
+    return -1;
+}
+int rename_check(struct wfs_inode *inode, struct wfs_inode *old) { //0 if inode may replace old (NULL when the target name is free)
+    if (old == NULL) {
+        return 0;
+    }
+    if (S_ISDIR(inode->mode) && !S_ISDIR(old->mode)) {
+        return -ENOTDIR;
+    }
+    if (!S_ISDIR(inode->mode) && S_ISDIR(old->mode)) {
+        return -EISDIR;
+    }
+    if (S_ISDIR(old->mode) && !dir_is_empty(old)) {
+        return -ENOTEMPTY;
+    }
+    return 0;
+}
+int dir_rename(struct wfs_inode *src_dir, const char *src_name, struct wfs_inode *dst_dir, const char *dst_name) { //shared by both frontends' rename, 0 or a negative errno
+    int locked[4] = {src_dir->num, dst_dir->num, -1, -1}; //directories, then the moved and the replaced inode
+    int rc = 0;
+    journal_begin_dir();
+    for(;;) {
+        int busy = trylock_all(locked, 2);
+        if (busy == -1) {
+            struct wfs_dentry *src = dir_find(src_dir, src_name);
+            struct wfs_dentry *dst = dir_find(dst_dir, dst_name);
+            if (src == NULL) {
+                rc = -ENOENT;
+            } else if (dst_dir->nlinks == 0) { //into a removed directory
+                rc = -ENOENT;
+            } else if (src->num == dst_dir->num) { //into itself
+                rc = -EINVAL;
+            } else if (dst != NULL && dst->num == src_dir->num) { //over its own parent, which isn't empty
+                rc = -ENOTEMPTY;
+            } else if (dst != NULL && dst->num == src->num) { //two names for one inode: nothing to do
+                rc = 1;
+            }
+            if (rc != 0) {
+                unlock_all(locked, 2);
+                journal_end();
+                return rc < 0 ? rc : 0;
+            }
+            locked[2] = src->num;
+            locked[3] = dst == NULL ? -1 : dst->num;
+            busy = trylock_all(locked + 2, 2);
+            if (busy == -1) {
+                break;
+            }
+            unlock_all(locked, 2);
+        }
+        pthread_rwlock_wrlock(&inode_locks[busy]); //nothing is held here
+        pthread_rwlock_unlock(&inode_locks[busy]);
+    }
+    struct wfs_inode *inode = inode_at(locked[2]);
+    struct wfs_inode *old = locked[3] == -1 ? NULL : inode_at(locked[3]);
+    rc = rename_check(inode, old);
+    if (rc == 0 && old == NULL && dir_add_entry(dst_dir, dst_name, inode->num) == NULL) { //before anything changes, so a full disk leaves both directories as they were
+        rc = -ENOSPC;
+    }
+    if (rc != 0) {
+        unlock_all(locked, 4);
+        journal_end();
+        return rc;
+    }
+    if (old != NULL) {
+        struct wfs_dentry *slot = dir_find(dst_dir, dst_name);
+        slot->num = inode->num;
+        journal_dirty(slot, sizeof(struct wfs_dentry));
+        dst_dir->mtim = time(NULL);
+        dst_dir->ctim = time(NULL);
+        dcache_insert(dst_dir->num, dst_name, inode->num);
+        old->nlinks = 0;
+        old->ctim = time(NULL);
+        inode_dirty(old);
+        if (S_ISDIR(old->mode)) {
+            dst_dir->nlinks--;
+        }
+    }
+    dir_remove_entry(src_dir, src_name); //looked up again, dir_add_entry may have rehashed the table
+    if (S_ISDIR(inode->mode) && src_dir != dst_dir) {
+        src_dir->nlinks--;
+        dst_dir->nlinks++;
+    }
+    inode->ctim = time(NULL);
+    inode_dirty(inode);
+    inode_dirty(src_dir);
+    inode_dirty(dst_dir);
+    unlock_all(locked, 3); //the replaced inode stays locked alone, inode_release may step
+    if (old != NULL) {
+        inode_release(old); //its dentry points elsewhere now
+        inode_unlock(old);
+    }
+    journal_end();
+    return 0;
+}
+int create_node(const char *path, mode_t mode) { //shared by mkdir and mknod
+    struct wfs_inode_and_child parent;
+    int rc = get_parent_inode(path, &parent);
+    if (rc != 0) { //if parent not found, return enoent
+        return rc;
+    }
+    rc = dir_create(parent.inode, parent.child, mode, 0);
+    return rc < 0 ? rc : 0;
+}
+int remove_node(const char *path, int is_dir) { //shared by rmdir and unlink
+    struct wfs_inode_and_child parent;
+    int rc = get_parent_inode(path, &parent);
+    if (rc != 0) {
+        return rc;
+    }
+    return dir_remove(parent.inode, parent.child, is_dir);
+}
+
+int wfs_mkdir(const char *path, mode_t mode) {
+    TRACE_BEGIN();
+    int rc = create_node(path, mode | __S_IFDIR);
+    TRACE_END(TRACE_MKDIR, -1, 0, 0, rc);
+    return rc;
+}
+
+int wfs_rmdir(const char *path) {
+    if (strcmp(path, "/") == 0) {
+        return -EBUSY;
+    }
+    TRACE_BEGIN();
+    int rc = remove_node(path, 1);
+    TRACE_END(TRACE_RMDIR, -1, 0, 0, rc);
+    return rc;
+}
+
+int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
+    TRACE_BEGIN();
+    int rc = create_node(path, mode);
+    TRACE_END(TRACE_MKNOD, -1, 0, 0, rc);
+    return rc;
+}
+
+int wfs_unlink(const char *path) {
+    TRACE_BEGIN();
+    int rc = remove_node(path, 0);
+    TRACE_END(TRACE_UNLINK, -1, 0, 0, rc);
+    return rc;
+}
+
+int wfs_rename(const char *from, const char *to) {
+    size_t len = strlen(from);
+    if (strncmp(from, to, len) == 0 && to[len] == '/') { //a directory into its own subtree
+        return -EINVAL;
+    }
+    TRACE_BEGIN();
+    struct wfs_inode_and_child src, dst;
+    int rc = get_parent_inode(from, &src);
+    if (rc == 0) {
+        rc = get_parent_inode(to, &dst);
+    }
+    if (rc == 0) {
+        rc = dir_rename(src.inode, src.child, dst.inode, dst.child);
+    }
+    TRACE_END(TRACE_RENAME, -1, 0, 0, rc);
+    return rc;
+}
+
+/*
+  Open handles. open and opendir resolve the path once and keep a
+  wfs_handle in fi->fh, so read, write and readdir on an open file skip
+  the path walk; a call without a handle (fh 0) still resolves its path.
+  A handle remembers the last run of blocks its reads mapped, which spares
+  an extent file the walk down its extent list for every chunk, and it
+  detects sequential reads to prefetch the next window of the image. A
+  directory's handle keeps the listing readdir resumes in, see
+  dir_listing_take; the low-level frontend opens directories for that.
+  Concurrent reads through one handle use the cache only while they hold
+  its mutex; the others map the slow way.
+*/
+#define READAHEAD_BYTES (1 << 20)
+
+struct map_cursor { //a run of mapped blocks, valid while map_gens[num] is unchanged
+    unsigned long gen;
+    long lblk;        // first logical block of the run
+    long len;         // 0 if nothing is cached
+    off_t address;
+};
+struct wfs_handle {
+    int num;                // the open inode
+    pthread_mutex_t lock;   // covers the fields below
+    struct map_cursor cursor;
+    off_t next_offset;      // where a read continuing the last one starts
+    int sequential;         // reads in a row that started at next_offset
+    off_t ra_end;           // file offset readahead has been issued up to
+    struct dir_listing listing; // an open directory's names, see dir_listing_take
+};
+struct wfs_handle *handle_of(struct fuse_file_info *fi) {
+    return fi == NULL ? NULL : (struct wfs_handle *)(uintptr_t)fi->fh;
+}
+struct wfs_inode *handle_inode(const char *path, struct fuse_file_info *fi) { //the open inode, or the path resolved the old way, see find_inode for errno
+    struct wfs_handle *handle = handle_of(fi);
+    return handle != NULL ? inode_at(handle->num) : find_inode(path);
+}
+int handle_open(struct fuse_file_info *fi, int num) {
+    struct wfs_handle *handle = calloc(1, sizeof(struct wfs_handle));
+    if (handle == NULL) {
+        return -ENOMEM;
+    }
+    handle->num = num;
+    pthread_mutex_init(&handle->lock, NULL);
+    fi->fh = (uintptr_t)handle;
+    inode_rdlock(inode_at(num));
+    inode_get(open_counts, inode_at(num)); //keeps the inode after unlink, see inode_release
+    inode_unlock(inode_at(num));
+    return 0;
+}
+void handle_release(struct fuse_file_info *fi) {
+    struct wfs_handle *handle = handle_of(fi);
+    if (handle != NULL) {
+        int num = handle->num;
+        free(handle->listing.entries);
+        pthread_mutex_destroy(&handle->lock);
+        free(handle);
+        fi->fh = 0;
+        inode_put(open_counts, inode_at(num), 1);
+    }
+}
+struct dir_listing *handle_listing(struct fuse_file_info *fi) { //the handle's listing, locked until handle_listing_put; NULL without a handle
+    struct wfs_handle *handle = handle_of(fi);
+    if (handle == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&handle->lock);
+    return &handle->listing;
+}
+void handle_listing_put(struct fuse_file_info *fi) {
+    struct wfs_handle *handle = handle_of(fi);
+    if (handle != NULL) {
+        pthread_mutex_unlock(&handle->lock);
+    }
+}
+struct map_cursor *handle_read_begin(struct wfs_handle *handle) { //the cursor to map through, NULL if there is no handle or it is busy
+    if (handle == NULL || pthread_mutex_trylock(&handle->lock) != 0) {
+        return NULL;
+    }
+    return &handle->cursor;
+}
+void handle_read_end(struct wfs_handle *handle, struct map_cursor *cursor, struct wfs_inode *inode, off_t offset, long bytes) { //caller holds the inode's read lock
+    if (cursor == NULL) {
+        return;
+    }
+    handle->sequential = offset == handle->next_offset ? handle->sequential + 1 : 0;
+    handle->next_offset = offset + (bytes > 0 ? bytes : 0);
+    if (handle->sequential >= 2 && handle->ra_end - handle->next_offset < READAHEAD_BYTES / 2) { //sequential and the prefetched window is half used
+        off_t from = handle->ra_end > handle->next_offset ? handle->ra_end : handle->next_offset;
+        off_t to = from + READAHEAD_BYTES < inode->size ? from + READAHEAD_BYTES : inode->size;
+        long lblk = from / block_size;
+        long end = (to + block_size - 1) / block_size;
+        while (lblk < end && !(inode->flags & WFS_INODE_INLINE)) {
+            long run;
+            off_t address = map_block(inode, lblk, &run, end - lblk);
+            if (address != 0) {
+                posix_fadvise(image_fd, address, run * block_size, POSIX_FADV_WILLNEED);
+            }
+            lblk += run;
+        }
+        handle->ra_end = to;
+    }
+    pthread_mutex_unlock(&handle->lock);
+}
+off_t map_block_cached(struct wfs_inode *inode, struct map_cursor *cursor, long lblk, long *run, long max_run) { //map_block, answered from cursor when it covers lblk; cursor may be NULL
+    if (cursor == NULL) {
+        return map_block(inode, lblk, run, max_run);
+    }
+    if (cursor->gen != map_gens[inode->num] || lblk < cursor->lblk || lblk >= cursor->lblk + cursor->len) {
+        long len;
+        off_t address = map_block(inode, lblk, &len, uses_extents(inode) ? LONG_MAX : max_run); //the rest of an extent costs nothing extra
+        if (address == 0) {
+            *run = len < max_run ? len : max_run;
+            return 0;
+        }
+        cursor->gen = map_gens[inode->num];
+        cursor->lblk = lblk;
+        cursor->len = len;
+        cursor->address = address;
+    }
+    long into = lblk - cursor->lblk;
+    *run = cursor->len - into < max_run ? cursor->len - into : max_run;
+    return cursor->address + into * block_size;
+}
+int wfs_open(const char *path, struct fuse_file_info *fi) {
+    struct wfs_inode *inode = find_inode(path);
+    if (inode == NULL) {
+        return -errno;
+    }
+    return handle_open(fi, inode->num);
+}
+int wfs_release(const char *path, struct fuse_file_info *fi) {
+    handle_release(fi);
+    return 0;
+}
+int wfs_opendir(const char *path, struct fuse_file_info *fi) {
+    struct wfs_inode *inode = find_inode(path);
+    if (inode == NULL) {
+        return -errno;
+    }
+    if (!S_ISDIR(inode->mode)) {
+        return -ENOTDIR;
+    }
+    return handle_open(fi, inode->num);
+}
+int wfs_releasedir(const char *path, struct fuse_file_info *fi) {
+    handle_release(fi);
+    return 0;
+}
+
+int read_inode(struct wfs_inode *curr_inode, char *buf, size_t size, off_t offset, struct map_cursor *cursor) { //caller holds at least a read lock, cursor may be NULL
+    if(offset >= curr_inode->size) {
+        return 0;
+    }
+    long bytes_left = size;
+    if (curr_inode->size - offset < bytes_left) {
+        bytes_left = curr_inode->size - offset;
+    }
+    if (curr_inode->flags & WFS_INODE_INLINE) {
+        memcpy(buf, inline_data(curr_inode) + offset, bytes_left);
+        return bytes_left;
+    }
+    long bytes_read = 0;
+    while(bytes_left > 0) { //one pread/pwrite per physically contiguous run
+        long block_offset = offset % block_size;
+        long run;
+        off_t address = map_block_cached(curr_inode, cursor, offset / block_size, &run, (block_offset + bytes_left + block_size - 1) / block_size);
+        long quantity = run * block_size - block_offset;
+        if (quantity > bytes_left) {
+            quantity = bytes_left;
+        }
+        if (address == 0) { //a hole
+            memset(buf, 0, quantity);
+        } else {
+            int rc = image_io(0, buf, quantity, address + block_offset);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        buf += quantity;
+        offset += quantity;
+        bytes_left -= quantity;
+        bytes_read += quantity;
+    }
+    return bytes_read;
+}
+
+int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_handle *handle = handle_of(fi);
+    struct wfs_inode *curr_inode = handle_inode(path, fi);
+    if(curr_inode == NULL) {
+        int err = errno;
+        TRACE_END(TRACE_READ, -1, offset, size, -err);
+        return -err;
+    }
+    inode_rdlock(curr_inode); //readers of the same file run concurrently
+    struct map_cursor *cursor = handle_read_begin(handle);
+    int rc = read_inode(curr_inode, buf, size, offset, cursor);
+    handle_read_end(handle, cursor, curr_inode, offset, rc);
+    inode_unlock(curr_inode);
+    TRACE_END(TRACE_READ, curr_inode->num, offset, size, rc);
+    return rc;
+}
+
+/*
+  Inline files. The data is metadata like the inode around it: it is
+  changed through the mapping and journaled, and fsync gets it to disk with
+  the journal commit. Bytes between the old size and a write past it are
+  zeroed here, so stale slot contents never show up as file data.
+*/
+int write_inline(struct wfs_inode *inode, const char *buf, size_t size, off_t offset) { //offset + size fits in inline_capacity
+    char *data = inline_data(inode);
+    long from = offset < inode->size ? offset : inode->size;
+    if (offset > inode->size) {
+        memset(data + inode->size, 0, offset - inode->size);
+    }
+    memcpy(data + offset, buf, size);
+    journal_dirty(data + from, offset + size - from);
+    if (inode->size < (off_t)(offset + size)) {
+        inode->size = offset + size;
+    }
+    inode_modified(inode);
+    inode_dirty(inode);
+    return size;
+}
+int promote_inline(struct wfs_inode *inode) { //moves an inline file's data to blocks, caller holds the write lock
+    char data[INODE_SLOT];
+    long size = inode->size;
+    memcpy(data, inline_data(inode), size);
+    inode->flags &= ~WFS_INODE_INLINE;
+    inode->size = 0;
+    int rc = size > 0 ? write_inode(inode, data, size, 0) : 0;
+    if (rc < 0) { //stay inline, the slot bytes were not touched
+        free_inode_data(inode);
+        inode->flags |= WFS_INODE_INLINE;
+        inode->size = size;
+        return rc;
+    }
+    return 0;
+}
+size_t write_step(off_t offset, size_t size) { //a write maps at most WFS_JOURNAL_STEP blocks, more is cut short; the kernel never sends that much
+    size_t most = WFS_JOURNAL_STEP * block_size - offset % block_size;
+    return size < most ? size : most;
+}
+int write_inode(struct wfs_inode *curr_inode, const char *buf, size_t size, off_t offset) { //caller holds the write lock
+    size = write_step(offset, size);
+    long new_file_end_byte = (long)offset + size; // how much the file wants to extend its contents in memory, if any. Also is the new size
+    if (new_file_end_byte <= offset) {
+        return 0;
+    }
+    if (curr_inode->flags & WFS_INODE_INLINE) {
+        if (new_file_end_byte <= inline_capacity) {
+            return write_inline(curr_inode, buf, size, offset);
+        }
+        int rc = promote_inline(curr_inode);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    inode_dirty(curr_inode); //grow_file may map blocks even if it fails
+    long keep_first = (offset + block_size - 1) / block_size; //blocks this write covers completely need no zeroing
+    long keep_end = new_file_end_byte / block_size;
+    long old_end = (curr_inode->size + block_size - 1) / block_size;
+    int rc = grow_file(curr_inode, offset / block_size, (new_file_end_byte + block_size - 1) / block_size, keep_first, keep_end);
+    if (rc != 0) {
+        zero_file_blocks(curr_inode, keep_first > old_end ? keep_first : old_end, keep_end);
+        return rc;
+    }
+    long bytes_left = new_file_end_byte - (long)offset;
+    long bytes_written = 0;
+    while(bytes_left > 0) { //one pread/pwrite per physically contiguous run
+        long block_offset = offset % block_size;
+        long run;
+        off_t address = map_block(curr_inode, offset / block_size, &run, (block_offset + bytes_left + block_size - 1) / block_size);
+        long quantity = run * block_size - block_offset;
+        if (quantity > bytes_left) {
+            quantity = bytes_left;
+        }
+        rc = image_io(1, (char *)buf, quantity, address + block_offset);
+        if (rc != 0) {
+            zero_file_blocks(curr_inode, keep_first > old_end ? keep_first : old_end, keep_end);
+            return rc;
+        }
+        writeback_dirty(curr_inode->num, address + block_offset, quantity);
+        buf += quantity;
+        offset += quantity;
+        bytes_left -= quantity;
+        bytes_written += quantity;
+    }
+    if(curr_inode->size < new_file_end_byte) {
+        curr_inode->size = new_file_end_byte;
+    }
+    inode_modified(curr_inode);
+    return (int)bytes_written;
+}
+
+int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *curr_inode = handle_inode(path, fi);
+    if(curr_inode == NULL) {
+        int err = errno;
+        TRACE_END(TRACE_WRITE, -1, offset, size, -err);
+        return -err;
+    }
+    int rc;
+    int tries = 0;
+    do {
+        journal_begin();
+        inode_wrlock(curr_inode);
+        rc = write_inode(curr_inode, buf, size, offset);
+        inode_unlock(curr_inode);
+        journal_end();
+    } while (retry_alloc(rc, &tries));
+    TRACE_END(TRACE_WRITE, curr_inode->num, offset, size, rc);
+    return rc;
+}
+ 
+/*
+  Buffer-based I/O. Instead of copying through the mapping, the file's
+  blocks are described as fd segments of the image (one per physically
+  contiguous run) and libfuse moves the data with splice or pread/pwrite.
+  File data never goes through the mapping, so this is safe even when the
+  mapping is private. A hole becomes a zeroed memory segment, which libfuse
+  frees like any other.
+*/
+void free_bufvec(struct fuse_bufvec *vec) { //what high-level libfuse does with a read_buf result
+    if (vec != NULL) {
+        for(size_t i = 0; i < vec->count; ++i) {
+            free(vec->buf[i].mem);
+        }
+        free(vec);
+    }
+}
+struct fuse_bufvec *map_range(struct wfs_inode *inode, off_t offset, size_t size, struct map_cursor *cursor) { //segments covering bytes [offset, offset + size), NULL if out of memory
+    long max_segments = size / block_size + 2;
+    struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec) + max_segments * sizeof(struct fuse_buf));
+    if (vec == NULL) {
+        return NULL;
+    }
+    *vec = FUSE_BUFVEC_INIT(0);
+    vec->count = 0;
+    while (size > 0) {
+        long block_offset = offset % block_size;
+        long run;
+        off_t address = map_block_cached(inode, cursor, offset / block_size, &run, (block_offset + size + block_size - 1) / block_size);
+        size_t quantity = run * block_size - block_offset;
+        if (quantity > size) {
+            quantity = size;
+        }
+        struct fuse_buf *seg = &vec->buf[vec->count++];
+        seg->size = quantity;
+        seg->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        seg->mem = NULL;
+        seg->fd = image_fd;
+        seg->pos = address + block_offset;
+        if (address == 0) {
+            seg->flags = 0;
+            seg->mem = calloc(1, quantity);
+            if (seg->mem == NULL) {
+                free_bufvec(vec);
+                return NULL;
+            }
+        }
+        offset += quantity;
+        size -= quantity;
+    }
+    return vec;
+}
+struct fuse_bufvec *read_inode_buf(struct wfs_inode *inode, size_t size, off_t offset, struct map_cursor *cursor) { //caller holds at least a read lock, cursor may be NULL
+    if (offset >= inode->size) {
+        size = 0;
+    } else if (inode->size - offset < size) {
+        size = inode->size - offset;
+    }
+    if (inode->flags & WFS_INODE_INLINE) { //a memory copy, the slot may change once the caller unlocks
+        struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec));
+        char *data = malloc(size + 1);
+        if (vec == NULL || data == NULL) {
+            free(vec);
+            free(data);
+            return NULL;
+        }
+        *vec = FUSE_BUFVEC_INIT(size);
+        vec->buf[0].mem = data;
+        memcpy(data, inline_data(inode) + offset, size);
+        return vec;
+    }
+    return map_range(inode, offset, size, cursor);
+}
+int write_inode_buf(struct wfs_inode *inode, struct fuse_bufvec *buf, off_t offset) { //caller holds the write lock
+    size_t size = write_step(offset, fuse_buf_size(buf));
+    if (size == 0) {
+        return 0;
+    }
+    if (inode->flags & WFS_INODE_INLINE) {
+        if (offset + size <= (size_t)inline_capacity) {
+            char data[INODE_SLOT];
+            struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+            mem.buf[0].mem = data;
+            ssize_t copied = fuse_buf_copy(&mem, buf, 0);
+            return copied > 0 ? write_inline(inode, data, copied, offset) : copied;
+        }
+        int rc = promote_inline(inode);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    inode_dirty(inode); //grow_file may map blocks even if it fails
+    long keep_first = (offset + block_size - 1) / block_size; //blocks this write covers completely need no zeroing
+    long keep_end = (offset + size) / block_size;
+    long old_end = (inode->size + block_size - 1) / block_size;
+    int rc = grow_file(inode, offset / block_size, (offset + size + block_size - 1) / block_size, keep_first, keep_end);
+    if (rc != 0) {
+        zero_file_blocks(inode, keep_first > old_end ? keep_first : old_end, keep_end);
+        return rc;
+    }
+    struct fuse_bufvec *dst = map_range(inode, offset, size, NULL);
+    if (dst == NULL) {
+        zero_file_blocks(inode, keep_first > old_end ? keep_first : old_end, keep_end);
+        return -ENOMEM;
+    }
+    ssize_t written = fuse_buf_copy(dst, buf, 0);
+    for(size_t i = 0; i < dst->count; ++i) { //even after a short copy: those blocks may be dirty in part
+        writeback_dirty(inode->num, dst->buf[i].pos, dst->buf[i].size);
+    }
+    free(dst);
+    if (written < (ssize_t)size) { //the new blocks past what was copied were never zeroed
+        long copied_end = (offset + (written > 0 ? written : 0) + block_size - 1) / block_size;
+        long first = keep_first > old_end ? keep_first : old_end;
+        zero_file_blocks(inode, first > copied_end ? first : copied_end, keep_end);
+    }
+    if (written < 0) {
+        return written;
+    }
+    if (inode->size < offset + written) {
+        inode->size = offset + written;
+    }
+    if (written > 0) {
+        inode_modified(inode);
+    }
+    return written;
+}
+/*
+  Truncate and hole punching. Whole blocks leave the map in bulk: an
+  indirect block entirely inside the range is freed with everything below
+  it without looking at its pointers one level down, and one that ends up
+  with no pointers left is freed too. A partial block at either end is
+  zeroed in place instead. Mapped bytes past the size are always zero, so
+  truncate zeroes the tail of the block the new size ends in, and a later
+  extension reads zeros there. Blocks fallocated past the size go as well.
+  Extent files cut the extents the range covers, free their blocks and
+  put a hole extent in their place, merging it with holes next to it; a
+  hole that would end the list is dropped instead.
+*/
+long unmap_tree(off_t *slot, int depth, long base, long first, long end) { //frees what *slot maps of logical blocks [first, end), base is the first block under it; returns the blocks freed
+    long span = 1;
+    for(int d = 0; d < depth; ++d) {
+        span *= ptrs_per_block;
+    }
+    if (*slot == 0 || end <= base || base + span <= first) {
+        return 0;
+    }
+    long freed = 0;
+    if (first <= base && base + span <= end) {
+        freed = free_block_tree(*slot, depth);
+    } else {
+        off_t *pointers = (off_t *)(image + *slot);
+        int live = 0;
+        for(int i = 0; i < ptrs_per_block; ++i) {
+            freed += unmap_tree(&pointers[i], depth - 1, base + i * (span / ptrs_per_block), first, end);
+            live |= pointers[i] != 0;
+        }
+        if (live) {
+            return freed;
+        }
+        free_data_block(*slot);
+        ++freed;
+    }
+    *slot = 0;
+    journal_dirty(slot, sizeof(off_t));
+    return freed;
+}
+void unmap_blocks(struct wfs_inode *inode, long first, long end) { //frees logical blocks [first, end) of a block-pointer file, caller holds the write lock
+    long base = 0;
+    long span = 1;
+    map_gens[inode->num]++;
+    for(int j = 0; j < N_BLOCKS; ++j) {
+        if (j > D_BLOCK) {
+            span *= ptrs_per_block;
+        }
+        inode->used_blocks -= unmap_tree(&inode->blocks[j], j <= D_BLOCK ? 0 : j - D_BLOCK, base, first, end);
+        base += span;
+    }
+}
+long tree_end(off_t address, int depth, long base, long limit) { //one past the last data block mapped below limit under address, which starts at base; 0 if none
+    if (depth == 0) {
+        return base + 1;
+    }
+    long span = 1;
+    for(int d = 1; d < depth; ++d) {
+        span *= ptrs_per_block;
+    }
+    off_t *pointers = (off_t*)(image + address);
+    long i = (limit - 1 - base) / span < ptrs_per_block ? (limit - 1 - base) / span : ptrs_per_block - 1;
+    for(; i >= 0; --i) {
+        long end = pointers[i] != 0 ? tree_end(pointers[i], depth - 1, base + i * span, limit) : 0;
+        if (end != 0) {
+            return end;
         }
-        if (used_blocks == 8) {//indirect blocks already being used. See how many indirect pointers they already have and set pointer to the first unused one
-            address_pointer_offset = (long*)(image + curr_inode->blocks[7]);
-            for(int j = 0; j < 64; ++j) {
-                if(*address_pointer_offset != 0) {
-                    printf("j is %d, value is %ld\n", j, *address_pointer_offset);
-                    ++indirect_blocks_used;
-                    ++address_pointer_offset;
-                }
+    }
+    return 0;
+}
+long map_end(struct wfs_inode *inode, long limit) { //one past the last mapped logical block below limit, 0 if there is none
+    if (uses_extents(inode)) {
+        long at = 0;
+        long end = 0;
+        struct extent_iter it = { NULL, 0, -1 };
+        struct wfs_extent *slot;
+        while ((slot = extent_next(inode, &it)) != NULL && slot->len != 0 && at < limit) {
+            if (slot->start != WFS_EXTENT_HOLE) {
+                end = at + slot->len < limit ? at + slot->len : limit;
             }
-            address_pointer_offset = ((long*)(image + curr_inode->blocks[7])) + indirect_blocks_used;
-
+            at += slot->len;
         }
-        while(new_memory_needed > 0) { //let's allocate all the blocks we need for the write
-            if(used_blocks < 7) { //this means that we can still directly allocate the blocks
-                returned = get_new_data_block(curr_inode);
-                if(returned == -1) {
-                    return -ENOSPC; //didn't find a new data block, because it is out of space
-                }
-                clear_block(image + curr_inode->blocks[returned], 1);
-                ++used_blocks;
-                new_memory_needed -= 512;
-            } else if (used_blocks == 7) { //allocate indirect block
-                returned = get_new_data_block(curr_inode);
-                if(returned == -1) {
-                    return -ENOSPC; //didn't find a new data block, because it is out of space
-                    printf("second enospc\n");
-                }
-                curr_inode->blocks[7] = returned;
-                clear_block(image + curr_inode->blocks[7], 1);
-                address_pointer_offset = (long*)(image + curr_inode->blocks[7]); //sets the pointer to the newly allocated indirect block
-                ++used_blocks;
-            } else {
-                if(indirect_blocks_used >= 64) {
-                    return -ENOSPC; // file is exceeding max file size
-                    printf("third enospc\n");
-                }
-                long returned = get_new_data_block(curr_inode);
-                if(returned == -1) {
-                    return -ENOSPC; // no more space in system
-                    printf("fourth enospc\n");
-                }
-                clear_block(image + returned, 1);
-                *address_pointer_offset = returned;//sets the value of the pointer in this address
-                ++address_pointer_offset;//updates the pointer itself
-                ++indirect_blocks_used;//updates number of indirect blocks used
-                new_memory_needed -= 512;
+        return end;
+    }
+    long base[N_BLOCKS]; //first logical block under each slot, as in unmap_blocks
+    long span = 1;
+    long next = 0;
+    for(int j = 0; j < N_BLOCKS; ++j) {
+        if (j > D_BLOCK) {
+            span *= ptrs_per_block;
+        }
+        base[j] = next;
+        next += span;
+    }
+    for(int j = N_BLOCKS - 1; j >= 0; --j) {
+        if (inode->blocks[j] != 0 && base[j] < limit) {
+            long end = tree_end(inode->blocks[j], j <= D_BLOCK ? 0 : j - D_BLOCK, base[j], limit);
+            if (end != 0) {
+                return end;
             }
         }
     }
-    long block_number = offset / 512;
-    long indirect_index = -1;
-    char* pointer;
-    long bytes_written = 0;
-    int was_only_direct = 0;
-    if(block_number > 6) { //if block number is less than 6, setting the initial pointer to the block. If greater, setting it according to indirect block
-        indirect_index = block_number - 7;
-        address_pointer_offset = ((long*)(image + curr_inode->blocks[7])) + indirect_index;
-        pointer = image + *address_pointer_offset;
+    return 0;
+}
+void truncate_extents(struct wfs_inode *inode, long keep) { //frees logical blocks keep and up of an extent file, caller holds the write lock
+    long at = 0; //logical block where slot starts
+    struct extent_iter it = { NULL, 0, -1 };
+    struct extent_iter kept = { NULL, 0, -1 }; //at the last extent that stays
+    struct wfs_extent *slot;
+    map_gens[inode->num]++;
+    while ((slot = extent_next(inode, &it)) != NULL && slot->len != 0 && at + slot->len <= keep) {
+        at += slot->len;
+        kept = it;
+    }
+    if (slot == NULL || slot->len == 0) {
+        return;
+    }
+    if (slot->start != WFS_EXTENT_HOLE && at < keep) { //keep the front of the extent keep falls in
+        long from = keep - at;
+        free_data_run(slot->start + from, slot->len - from);
+        inode->used_blocks -= slot->len - from;
+        slot->len = from;
+        journal_dirty(slot, sizeof(*slot));
+        kept = it;
+        slot = extent_next(inode, &it);
+    }
+    for(; slot != NULL && slot->len != 0; slot = extent_next(inode, &it)) {
+        if (slot->start != WFS_EXTENT_HOLE) {
+            free_data_run(slot->start, slot->len);
+            inode->used_blocks -= slot->len;
+        }
+    }
+    int cap = N_EXTENTS;
+    struct wfs_extent *array = kept.slot != NULL ? extent_array(inode, &kept, &cap) : inode->extents;
+    int cut = kept.slot != NULL ? cap - kept.left + 1 : 0; //the list now ends here, in the array of the last extent kept
+    if (cut < cap) {
+        inode->used_blocks -= free_extent_blocks(&array[cap - 1]);
+        memset(&array[cut], 0, (cap - cut) * sizeof(*array));
+        journal_dirty(&array[cut], (cap - cut) * sizeof(*array));
+    }
+    extent_tidy(inode);
+}
+long truncate_step(struct wfs_inode *inode, long keep) { //frees logical blocks keep and up, or just the last WFS_JOURNAL_STEP mapped ones; returns where it cut, keep once it is done
+    long end = map_end(inode, LONG_MAX);
+    long from = end - WFS_JOURNAL_STEP > keep ? end - WFS_JOURNAL_STEP : keep;
+    if (uses_extents(inode)) {
+        truncate_extents(inode, from);
     } else {
-        was_only_direct = 1;
-        pointer = image + curr_inode->blocks[block_number];
-    }
-    long first_block_offset = offset % 512;
-    long bytes_left = new_file_end_byte - (long)offset; //size
-    int first_write = 1;
-    long quantity;
-    while(bytes_left != 0) {
-        if(block_number >= 7) { //if we reach block 7, we need to go to the next loop for the indirect blocks
+        unmap_blocks(inode, from, LONG_MAX);
+    }
+    return from;
+}
+int punch_extents(struct wfs_inode *inode, long first, long last) { //frees logical blocks [first, last) of an extent file and leaves a hole there, caller holds the write lock
+    int rc = 0;
+    map_gens[inode->num]++;
+    while (rc == 0) {
+        long at = 0;
+        struct extent_iter it = { NULL, 0, -1 };
+        struct wfs_extent *slot;
+        while ((slot = extent_next(inode, &it)) != NULL && slot->len != 0 && at < last) {
+            if (slot->start != WFS_EXTENT_HOLE && at + slot->len > first) {
+                break;
+            }
+            at += slot->len;
+        }
+        if (slot == NULL || slot->len == 0 || at >= last) {
             break;
         }
-        if(first_write) { //first read, need to consider offset
-            pointer += first_block_offset;
-            if(bytes_left < 512 - first_block_offset) {
-                quantity = bytes_left;
-            } else {
-                quantity = 512 - first_block_offset;
+        long lo = first > at ? first : at;
+        long hi = last < at + slot->len ? last : at + slot->len;
+        long start = slot->start + (lo - at);
+        struct wfs_extent with[3];
+        int n = 0;
+        if (lo > at) {
+            with[n++] = (struct wfs_extent){ slot->start, (int)(lo - at) };
+        }
+        with[n++] = (struct wfs_extent){ WFS_EXTENT_HOLE, (int)(hi - lo) };
+        if (hi < at + slot->len) {
+            with[n++] = (struct wfs_extent){ (int)(start + hi - lo), (int)(at + slot->len - hi) };
+        }
+        rc = extent_replace(inode, &it, with, n);
+        if (rc == 0) {
+            free_data_run(start, hi - lo);
+            inode->used_blocks -= hi - lo;
+        }
+    }
+    extent_tidy(inode);
+    return rc;
+}
+int zero_file_bytes(struct wfs_inode *inode, off_t from, off_t to) { //zeroes [from, to) inside one block of a block-backed file, if it is mapped
+    static const char zeros[MAX_BLOCK_SIZE];
+    long run;
+    off_t address = map_block(inode, from / block_size, &run, 1);
+    if (address == 0 || from >= to) {
+        return 0;
+    }
+    address += from % block_size;
+    writeback_dirty(inode->num, address, to - from);
+    return image_io(1, (char *)zeros, to - from, address);
+}
+int truncate_inode(struct wfs_inode *inode, off_t size) { //caller holds the write lock, and no other inode lock, see inode_step
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+    if (!S_ISREG(inode->mode)) {
+        return -EINVAL;
+    }
+    if ((inode->flags & WFS_INODE_INLINE) && size > inline_capacity) {
+        int rc = promote_inline(inode);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    if (inode->flags & WFS_INODE_INLINE) {
+        if (size > inode->size) {
+            memset(inline_data(inode) + inode->size, 0, size - inode->size);
+            journal_dirty(inline_data(inode) + inode->size, size - inode->size);
+        }
+    } else {
+        long keep = (size + block_size - 1) / block_size;
+        long from;
+        while ((from = truncate_step(inode, keep)) > keep) { //from the top, so the size never covers freed blocks
+            if (inode->size > from * block_size) {
+                inode->size = from * block_size;
             }
-            memcpy(pointer, buf, quantity);
-            bytes_left = bytes_left - quantity;
-            buf = buf + quantity;
-            block_number++;
-            pointer = image + curr_inode->blocks[block_number];
-            bytes_written = bytes_written + quantity;
-            first_write = 0;
-            continue;
+            inode_dirty(inode);
+            inode_step(inode);
+        }
+        if (size < inode->size && size % block_size != 0) {
+            int rc = zero_file_bytes(inode, size, keep * block_size);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+    }
+    inode->size = size;
+    inode_modified(inode);
+    inode->ctim = time(NULL);
+    inode_dirty(inode);
+    inode_release(inode); //a step may have let go of the last reference
+    return 0;
+}
+int punch_hole(struct wfs_inode *inode, off_t offset, off_t end) { //caller holds the write lock, the size stays
+    if (inode->flags & WFS_INODE_INLINE) {
+        if (end > inode->size) {
+            end = inode->size;
+        }
+        if (offset < end) {
+            memset(inline_data(inode) + offset, 0, end - offset);
+            journal_dirty(inline_data(inode) + offset, end - offset);
+        }
+        return 0;
+    }
+    long first = (offset + block_size - 1) / block_size; //whole blocks [first, last) are freed
+    long last = end / block_size;
+    if (first > last) { //inside one block
+        return zero_file_bytes(inode, offset, end);
+    }
+    int rc = zero_file_bytes(inode, offset, first * block_size);
+    if (rc == 0) {
+        rc = zero_file_bytes(inode, last * block_size, end);
+    }
+    long top;
+    while (rc == 0 && (top = map_end(inode, last)) > first) { //from the top a step at a time
+        long from = top - WFS_JOURNAL_STEP > first ? top - WFS_JOURNAL_STEP : first;
+        if (uses_extents(inode)) {
+            rc = punch_extents(inode, from, last);
+        } else {
+            unmap_blocks(inode, from, last);
         }
-        if (bytes_left >= 512) { //subsequent read, can copy whole 512 bytes because first read guarantees it
-            memcpy(pointer, buf, 512);
-            bytes_left -= 512;
-            buf += 512;
-            block_number++;
-            pointer = image + curr_inode->blocks[block_number];
-            bytes_written += 512;
-        } else { //last read if we don't need to get into the indirect block
-            memcpy(pointer, buf, bytes_left);
-            bytes_written += bytes_left;
-            bytes_left = 0;
-        }
-    }
-    if(was_only_direct) {//first time using indirect block, need to set the pointer accordingly. 
-    //If offset makes us write here first, pointer already set in one of the first ifs
-        indirect_index = 0;
-        address_pointer_offset = (long*)(image + curr_inode->blocks[7]);
-        pointer = image + *address_pointer_offset;
-    }
-    while(bytes_left != 0) {
-        if(indirect_index == 64) { //finished all indirect nodes
-            printf("In wfs_read, no more indirect indexes\n");
+        if (from == first) {
             break;
         }
-        if (first_write) { // we may be doing the first read form here, so need to take offset into account
-            if(bytes_left < 512 - first_block_offset) {
-                quantity = bytes_left;
-            } else {
-                quantity = 512 - first_block_offset;
+        inode_dirty(inode);
+        inode_step(inode);
+    }
+    return rc;
+}
+int fallocate_inode(struct wfs_inode *inode, int mode, off_t offset, off_t length) { //caller holds the write lock, and no other inode lock, see inode_step
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE) || ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if (!S_ISREG(inode->mode)) {
+        return -ENODEV;
+    }
+    long end = offset + length;
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        int rc = punch_hole(inode, offset, end);
+        inode_modified(inode);
+        inode->ctim = time(NULL);
+        inode_dirty(inode);
+        inode_release(inode); //a step may have let go of the last reference
+        return rc;
+    }
+    if (inode->flags & WFS_INODE_INLINE) {
+        if (end <= inline_capacity) { //the slot is always there, only the size can change
+            if (!(mode & FALLOC_FL_KEEP_SIZE) && inode->size < end) {
+                memset(inline_data(inode) + inode->size, 0, end - inode->size);
+                journal_dirty(inline_data(inode) + inode->size, end - inode->size);
+                inode->size = end;
             }
-            pointer += first_block_offset;
-            memcpy(pointer, buf, quantity);
-            bytes_left = bytes_left - quantity;
-            buf = buf + quantity;
-            ++address_pointer_offset;
-            pointer = image + *address_pointer_offset;
-            first_write = 0;
-            bytes_written = bytes_written + quantity;
-            continue;
+            inode->ctim = time(NULL);
+            inode_dirty(inode);
+            return 0;
         }
-        if(bytes_left >= 512) { //guaranteed to be 512 bytes long
-            memcpy(pointer, buf, 512);
-            bytes_left -= 512;
-            buf += 512;
-            ++address_pointer_offset;
-            pointer = image + *address_pointer_offset;
-            bytes_written += 512;
-        } else { //last read
-            memcpy(pointer, buf, bytes_left);
-            bytes_written += bytes_left;
-            bytes_left = 0;
+        int rc = promote_inline(inode);
+        if (rc != 0) {
+            return rc;
         }
-        ++indirect_index;
     }
-    if(curr_inode->size < new_file_end_byte) {
-        curr_inode->size = new_file_end_byte;
+    inode_dirty(inode);
+    long first = offset / block_size;
+    long nblocks = (end + block_size - 1) / block_size;
+    int rc = 0;
+    for(long lo = first; rc == 0 && lo < nblocks; lo += WFS_JOURNAL_STEP) {
+        if (lo > first) {
+            inode_step(inode);
+        }
+        rc = grow_file(inode, lo, nblocks - lo > WFS_JOURNAL_STEP ? lo + WFS_JOURNAL_STEP : nblocks, 0, 0);
     }
-    printf("finished write. Wrote %ld\n", bytes_written);
-    return (int)bytes_written;
+    if (rc == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && inode->size < end) {
+        inode->size = end;
+    }
+    inode->ctim = time(NULL);
+    inode_release(inode); //a step may have let go of the last reference
+    return rc;
 }
- 
-int main (int argc, char* argv[]) {
-    char *disk_img = argv[1];
+int wfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *inode = handle_inode(path, fi);
+    if (inode == NULL) {
+        int err = errno;
+        TRACE_END(TRACE_FALLOCATE, -1, offset, length, -err);
+        return -err;
+    }
+    int rc;
+    int tries = 0;
+    do {
+        journal_begin();
+        inode_wrlock(inode);
+        rc = fallocate_inode(inode, mode, offset, length);
+        inode_unlock(inode);
+        journal_end();
+    } while (retry_alloc(rc, &tries));
+    TRACE_END(TRACE_FALLOCATE, inode->num, offset, length, rc);
+    return rc;
+}
+int resize_node(struct wfs_inode *inode, off_t size) { //shared by truncate and ftruncate
+    journal_begin();
+    inode_wrlock(inode);
+    int rc = truncate_inode(inode, size);
+    inode_unlock(inode);
+    journal_end();
+    return rc;
+}
+int wfs_truncate(const char *path, off_t size) {
+    TRACE_BEGIN();
+    struct wfs_inode *inode = find_inode(path);
+    if (inode == NULL) {
+        int err = errno;
+        TRACE_END(TRACE_TRUNCATE, -1, size, 0, -err);
+        return -err;
+    }
+    int rc = resize_node(inode, size);
+    TRACE_END(TRACE_TRUNCATE, inode->num, size, 0, rc);
+    return rc;
+}
+int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *inode = handle_inode(path, fi);
+    if (inode == NULL) {
+        int err = errno;
+        TRACE_END(TRACE_TRUNCATE, -1, size, 0, -err);
+        return -err;
+    }
+    int rc = resize_node(inode, size);
+    TRACE_END(TRACE_TRUNCATE, inode->num, size, 0, rc);
+    return rc;
+}
+int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_handle *handle = handle_of(fi);
+    struct wfs_inode *curr_inode = handle_inode(path, fi);
+    if(curr_inode == NULL) {
+        int err = errno;
+        TRACE_END(TRACE_READ, -1, offset, size, -err);
+        return -err;
+    }
+    inode_rdlock(curr_inode);
+    struct map_cursor *cursor = handle_read_begin(handle);
+    *bufp = read_inode_buf(curr_inode, size, offset, cursor);
+    handle_read_end(handle, cursor, curr_inode, offset, *bufp == NULL ? 0 : fuse_buf_size(*bufp));
+    inode_unlock(curr_inode); //libfuse moves the data after we return, like a read racing a write
+    int rc = *bufp == NULL ? -ENOMEM : 0;
+    TRACE_END(TRACE_READ, curr_inode->num, offset, size, rc);
+    return rc;
+}
+int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *curr_inode = handle_inode(path, fi);
+    if(curr_inode == NULL) {
+        int err = errno;
+        TRACE_END(TRACE_WRITE, -1, offset, fuse_buf_size(buf), -err);
+        return -err;
+    }
+    int rc;
+    int tries = 0;
+    do {
+        journal_begin();
+        inode_wrlock(curr_inode);
+        rc = write_inode_buf(curr_inode, buf, offset);
+        inode_unlock(curr_inode);
+        journal_end();
+    } while (retry_alloc(rc, &tries));
+    TRACE_END(TRACE_WRITE, curr_inode->num, offset, fuse_buf_size(buf), rc);
+    return rc;
+}
+
+/*
+  Durability. fsync writes back the file's own dirty data ranges, then
+  commits metadata: through the journal if the image has one, otherwise by
+  msyncing the dirty metadata pages. flush, on every close, only starts the
+  writeback. A background thread writes back whatever has aged.
+*/
+int sync_inode(struct wfs_inode *inode) {
+    int rc = writeback_sync(inode->num, 1);
+    int meta = journal_commit(); //size and block map, which fdatasync needs as well
+    return rc != 0 ? rc : meta;
+}
+int wfs_flush(const char *path, struct fuse_file_info *fi) {
+    struct wfs_inode *inode = handle_inode(path, fi);
+    if (inode == NULL) {
+        return -errno;
+    }
+    return writeback_sync(inode->num, 0);
+}
+int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    struct wfs_inode *inode = handle_inode(path, fi);
+    if (inode == NULL) {
+        return -errno;
+    }
+    return sync_inode(inode);
+}
+int wfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    if (handle_inode(path, fi) == NULL) {
+        return -errno;
+    }
+    return journal_commit();
+}
+
+/*
+  Online growth. mkfs -g sized the bitmaps and the inode table for
+  max_inodes and max_data_blocks, and mount_image mapped the image up to
+  the last block it can grow to, so nothing moves: the file is extended and
+  the counts in the superblock go up. The counts are changed under the
+  bitmap locks, which are the only readers that care, so readers and
+  writers keep running. grow_lock serializes growers and is taken before
+  journal_begin.
+*/
+pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int grow_image(struct wfs_grow *req) { //0 or a negative errno, req gets the totals in effect
+    pthread_mutex_lock(&grow_lock);
+    size_t inodes = req->num_inodes ? (req->num_inodes + 31) & ~31ul : super->num_inodes;
+    size_t blocks = req->num_data_blocks ? (req->num_data_blocks + 31) & ~31ul : super->num_data_blocks;
+    size_t max_blocks = super->max_data_blocks ? super->max_data_blocks : super->num_data_blocks;
+    int rc = 0;
+    if (inodes < super->num_inodes || blocks < super->num_data_blocks) {
+        rc = -EINVAL; //shrinking would need the tail to be empty and moved
+    } else if (inodes > max_inodes || blocks > max_blocks) {
+        printf("grow: %zu inodes and %zu blocks asked, the image has room for at most %zu and %zu; mkfs -g factor reserves room to grow\n",
+            inodes, blocks, max_inodes, max_blocks);
+        rc = -EFBIG; //the bitmaps and the inode table have no room
+    }
+    struct stat st;
+    off_t end = block_address(blocks);
+    if (rc == 0 && fstat(image_fd, &st) == -1) {
+        rc = -errno;
+    }
+    if (rc == 0 && st.st_size < end && (ftruncate(image_fd, end) == -1 || fsync(image_fd) == -1)) {
+        rc = -errno; //the blocks must exist on disk before the superblock says so
+    }
+    if (rc == 0) {
+        journal_begin();
+        pthread_mutex_lock(&ibitmap_lock);
+        super->free_inodes += inodes - super->num_inodes;
+        super->num_inodes = inodes;
+        pthread_mutex_unlock(&ibitmap_lock);
+        pthread_mutex_lock(&dbitmap_lock);
+        super->free_data_blocks += blocks - super->num_data_blocks;
+        super->num_data_blocks = blocks;
+        pthread_mutex_unlock(&dbitmap_lock);
+        journal_dirty(super, sizeof(struct wfs_sb));
+        journal_end();
+        rc = journal_commit();
+    }
+    req->num_inodes = super->num_inodes;
+    req->num_data_blocks = super->num_data_blocks;
+    req->max_inodes = max_inodes;
+    req->max_data_blocks = max_blocks;
+    pthread_mutex_unlock(&grow_lock);
+    return rc;
+}
+int wfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    if ((unsigned int)cmd != WFS_IOC_GROW) {
+        return -ENOTTY;
+    }
+    if (handle_inode(path, fi) == NULL) {
+        return -errno;
+    }
+    return grow_image((struct wfs_grow *)data);
+}
+
+/*
+  Capability negotiation. Writes arrive in requests of up to WFS_MAX_WRITE
+  bytes instead of one page, reads may be sent asynchronously and ahead as
+  far as the kernel offers, and data moves by splice where libfuse can.
+  With --writeback-cache the kernel also collects small writes in its page
+  cache and sends them coalesced, page-aligned and clipped to the size it
+  keeps; it then owns mtime, so writes stop stamping it and the kernel
+  sends its own through setattr. The cache needs a libfuse that knows
+  FUSE_CAP_WRITEBACK_CACHE and a kernel that offers it.
+*/
+#define WFS_MAX_WRITE (128 * 1024)
+
+void conn_init(struct fuse_conn_info *conn) {
+    conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    conn->async_read = 1;
+    conn->max_write = WFS_MAX_WRITE;
+    // max_readahead stays at the kernel's offer, it can only be lowered here
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    if (writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    } else if (writeback_cache) {
+        printf("The kernel has no writeback cache for fuse, running without it\n");
+        writeback_cache = 0;
+    }
+#else
+    if (writeback_cache) {
+        printf("This libfuse has no writeback cache support, running without it\n");
+        writeback_cache = 0;
+    }
+#endif
+}
+/*
+  Times. wfs_utimens and the low-level setattr set atime and mtime, which
+  is also how the kernel hands over mtime with the writeback cache.
+*/
+void set_times(struct wfs_inode *inode, const struct timespec tv[2]) { //caller holds the write lock, UTIME_NOW and UTIME_OMIT work as in utimensat
+    time_t now = time(NULL);
+    if (tv[0].tv_nsec != UTIME_OMIT) {
+        inode->atim = tv[0].tv_nsec == UTIME_NOW ? now : tv[0].tv_sec;
+    }
+    if (tv[1].tv_nsec != UTIME_OMIT) {
+        inode->mtim = tv[1].tv_nsec == UTIME_NOW ? now : tv[1].tv_sec;
+    }
+    inode->ctim = now;
+    inode_dirty(inode);
+}
+int wfs_utimens(const char *path, const struct timespec tv[2]) {
+    struct wfs_inode *inode = find_inode(path);
+    if (inode == NULL) {
+        return -errno;
+    }
+    journal_begin();
+    inode_wrlock(inode);
+    set_times(inode, tv);
+    inode_unlock(inode);
+    journal_end();
+    return 0;
+}
+void fill_statfs(struct statvfs *st) { //from the free counts, no bitmap scan
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = block_size;
+    st->f_frsize = block_size;
+    st->f_blocks = super->num_data_blocks;
+    st->f_bfree = super->free_data_blocks;
+    st->f_bavail = super->free_data_blocks;
+    st->f_files = super->num_inodes;
+    st->f_ffree = super->free_inodes;
+    st->f_favail = super->free_inodes;
+    st->f_namemax = MAX_NAME - 1;
+}
+int wfs_statfs(const char *path, struct statvfs *st) {
+    fill_statfs(st);
+    return 0;
+}
+void *wfs_init(struct fuse_conn_info *conn) {
+    if (conn != NULL) { //NULL from the in-process benchmark
+        conn_init(conn);
+    }
+    if (journal_start_thread() != 0) {
+        perror("journal thread");
+    }
+    if (writeback_start_thread() != 0) {
+        perror("writeback thread");
+    }
+    return NULL;
+}
+void wfs_destroy(void *private_data) {
+    release_orphans(0); //the kernel is gone, and with it every lookup and handle
+    writeback_stop();
+    journal_close();
+    super->clean = 1; //everything is home, the free counts can be trusted next time
+    if (superblock_write() != 0) {
+        perror("superblock");
+    }
+    dcache_print_stats();
+    TRACE_DUMP();
+}
+
+/*
+  Low-level frontend, the default. The kernel hands us inode numbers, so
+  nothing is resolved by path: fuse inode ino is wfs inode ino - 1 (fuse
+  reserves 1 for the root, which is wfs inode 0). Every entry reply counts
+  a lookup that forget gives back, and carries the generation of the
+  inode number, see inode_release. Start wfs with --paths to use the
+  path-based operations above instead.
+*/
+#define LL_TIMEOUT (1.0) // seconds the kernel may cache attributes and entries
+
+struct wfs_inode *ll_inode(fuse_ino_t ino) { //NULL if ino is not an allocated inode
+    if (ino == 0 || ino > super->num_inodes || !bitmap_get((uint32_t *)(image + super->i_bitmap_ptr), ino - 1)) {
+        return NULL;
+    }
+    return inode_at(ino - 1);
+}
+struct wfs_inode *ll_dir(fuse_req_t req, fuse_ino_t ino, const char *name) { //the directory ino, or NULL after replying with an error
+    struct wfs_inode *dir = ll_inode(ino);
+    int err = dir == NULL ? ENOENT : !S_ISDIR(dir->mode) ? ENOTDIR : name != NULL && strlen(name) >= MAX_NAME ? ENAMETOOLONG : 0;
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return NULL;
+    }
+    return dir;
+}
+void ll_stat(struct wfs_inode *inode, struct stat *stbuf) { //caller holds inode's lock
+    fill_stat(inode, stbuf);
+    stbuf->st_ino = inode->num + 1;
+}
+void ll_fill_entry(struct fuse_entry_param *e, struct wfs_inode *inode) { //caller holds inode's lock and counted the lookup
+    memset(e, 0, sizeof(*e));
+    e->ino = inode->num + 1;
+    e->generation = inode_gens[inode->num];
+    e->attr_timeout = LL_TIMEOUT;
+    e->entry_timeout = LL_TIMEOUT;
+    ll_stat(inode, &e->attr);
+}
+void ll_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) {
+    if (fuse_reply_entry(req, e) == -ENOENT) { //interrupted, the kernel never got the lookup
+        inode_put(nlookups, inode_at(e->ino - 1), 1);
+    }
+}
+void wfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    TRACE_BEGIN();
+    struct wfs_inode *dir = ll_dir(req, parent, name);
+    if (dir == NULL) {
+        return;
+    }
+    inode_rdlock(dir);
+    int num = dir_lookup(dir, name);
+    if (num == -1) {
+        inode_unlock(dir);
+        fuse_reply_err(req, ENOENT);
+        TRACE_END(TRACE_GETATTR, -1, 0, 0, -ENOENT);
+        return;
+    }
+    struct wfs_inode *inode = inode_at(num);
+    struct fuse_entry_param e;
+    inode_rdlock(inode); //parent before child, so it can't be removed in between
+    inode_unlock(dir);
+    inode_get(nlookups, inode);
+    ll_fill_entry(&e, inode);
+    inode_unlock(inode);
+    ll_reply_entry(req, &e);
+    TRACE_END(TRACE_GETATTR, num, 0, e.attr.st_size, 0);
+}
+void wfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    struct wfs_inode *inode = ll_inode(ino);
+    if (inode != NULL) {
+        inode_put(nlookups, inode, nlookup);
+    }
+    fuse_reply_none(req);
+}
+void wfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *inode = ll_inode(ino);
+    if (inode == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct stat stbuf;
+    inode_rdlock(inode);
+    ll_stat(inode, &stbuf);
+    inode_unlock(inode);
+    fuse_reply_attr(req, &stbuf, LL_TIMEOUT);
+    TRACE_END(TRACE_GETATTR, inode->num, 0, stbuf.st_size, 0);
+}
+void wfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *dir = ll_dir(req, ino, NULL);
+    if (dir == NULL) {
+        return;
+    }
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t used = 0;
+    struct stat stbuf;
+    struct dir_listing own = { NULL, 0 };
+    inode_rdlock(dir);
+    struct dir_listing *listing = dir_listing_begin(fi, &own, dir, off);
+    if (listing == NULL) {
+        inode_unlock(dir);
+        free(buf);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int num;
+    const char *name;
+    for(long pos = off; (name = dir_entry_at(listing, pos, &num)) != NULL; ++pos) { //offsets as in wfs_readdir
+        dir_entry_stat(dir, pos, num, &stbuf);
+        stbuf.st_ino = num == -1 ? ino : (fuse_ino_t)num + 1;
+        size_t len = fuse_add_direntry(req, buf + used, size - used, name, &stbuf, pos + 1);
+        if (len > size - used) {
+            break;
+        }
+        used += len;
+    }
+    dir_listing_end(fi, &own);
+    inode_unlock(dir);
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+    TRACE_END(TRACE_READDIR, dir->num, off, used, 0);
+}
+void wfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *inode = ll_inode(ino);
+    if (inode == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct wfs_handle *handle = handle_of(fi);
+    inode_rdlock(inode);
+    struct map_cursor *cursor = handle_read_begin(handle);
+    struct fuse_bufvec *vec = read_inode_buf(inode, size, off, cursor);
+    handle_read_end(handle, cursor, inode, off, vec == NULL ? 0 : fuse_buf_size(vec));
+    if (vec == NULL) {
+        fuse_reply_err(req, ENOMEM);
+    } else {
+        fuse_reply_data(req, vec, 0); //spliced while the blocks can't change under us
+    }
+    inode_unlock(inode);
+    free_bufvec(vec);
+    TRACE_END(TRACE_READ, inode->num, off, size, 0);
+}
+void wfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) { //the inode is already known, the handle carries the read state
+    int rc = ll_inode(ino) == NULL ? -ENOENT : handle_open(fi, ino - 1);
+    if (rc != 0) {
+        fuse_reply_err(req, -rc);
+    } else if (fuse_reply_open(req, fi) == -ENOENT) { //the open was interrupted, release will never come
+        handle_release(fi);
+    }
+}
+void wfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) { //the handle keeps the listing, see dir_listing_take
+    if (ll_dir(req, ino, NULL) == NULL) {
+        return;
+    }
+    int rc = handle_open(fi, ino - 1);
+    if (rc != 0) {
+        fuse_reply_err(req, -rc);
+    } else if (fuse_reply_open(req, fi) == -ENOENT) {
+        handle_release(fi);
+    }
+}
+void wfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) { //also releasedir
+    handle_release(fi);
+    fuse_reply_err(req, 0);
+}
+void wfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *inode = ll_inode(ino);
+    if (inode == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int rc;
+    int tries = 0;
+    do {
+        journal_begin();
+        inode_wrlock(inode);
+        rc = write_inode(inode, buf, size, off);
+        inode_unlock(inode);
+        journal_end();
+    } while (retry_alloc(rc, &tries));
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+    } else {
+        fuse_reply_write(req, rc);
+    }
+    TRACE_END(TRACE_WRITE, inode->num, off, size, rc);
+}
+void wfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *inode = ll_inode(ino);
+    if (inode == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int rc;
+    int tries = 0;
+    do {
+        journal_begin();
+        inode_wrlock(inode);
+        rc = write_inode_buf(inode, bufv, off);
+        inode_unlock(inode);
+        journal_end();
+    } while (retry_alloc(rc, &tries));
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+    } else {
+        fuse_reply_write(req, rc);
+    }
+    TRACE_END(TRACE_WRITE, inode->num, off, fuse_buf_size(bufv), rc);
+}
+void wfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    wfs_init(conn);
+}
+void wfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct wfs_inode *inode = ll_inode(ino);
+    if (inode == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int times = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+    if (to_set & ~(times | FUSE_SET_ATTR_SIZE)) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    struct timespec tv[2];
+    tv[0].tv_sec = attr->st_atime;
+    tv[0].tv_nsec = to_set & FUSE_SET_ATTR_ATIME_NOW ? UTIME_NOW : to_set & FUSE_SET_ATTR_ATIME ? 0 : UTIME_OMIT;
+    tv[1].tv_sec = attr->st_mtime;
+    tv[1].tv_nsec = to_set & FUSE_SET_ATTR_MTIME_NOW ? UTIME_NOW : to_set & FUSE_SET_ATTR_MTIME ? 0 : UTIME_OMIT;
+    struct stat stbuf;
+    journal_begin();
+    inode_wrlock(inode);
+    if (to_set & FUSE_SET_ATTR_SIZE) { //truncate, or the size the kernel keeps with the writeback cache
+        int rc = truncate_inode(inode, attr->st_size);
+        if (rc != 0) {
+            inode_unlock(inode);
+            journal_end();
+            fuse_reply_err(req, -rc);
+            return;
+        }
+    }
+    if (to_set & times) {
+        set_times(inode, tv);
+    }
+    ll_stat(inode, &stbuf);
+    inode_unlock(inode);
+    journal_end();
+    fuse_reply_attr(req, &stbuf, LL_TIMEOUT);
+}
+void wfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct wfs_inode *inode = ll_inode(ino);
+    fuse_reply_err(req, inode == NULL ? ENOENT : -writeback_sync(inode->num, 0));
+}
+void wfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    struct wfs_inode *inode = ll_inode(ino);
+    fuse_reply_err(req, inode == NULL ? ENOENT : -sync_inode(inode));
+}
+void wfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, ll_inode(ino) == NULL ? ENOENT : -journal_commit());
+}
+void wfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    TRACE_BEGIN();
+    struct wfs_inode *inode = ll_inode(ino);
+    if (inode == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int rc;
+    int tries = 0;
+    do {
+        journal_begin();
+        inode_wrlock(inode);
+        rc = fallocate_inode(inode, mode, offset, length);
+        inode_unlock(inode);
+        journal_end();
+    } while (retry_alloc(rc, &tries));
+    fuse_reply_err(req, -rc);
+    TRACE_END(TRACE_FALLOCATE, inode->num, offset, length, rc);
+}
+void wfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+    if ((unsigned int)cmd != WFS_IOC_GROW || in_bufsz < sizeof(struct wfs_grow)) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    if (ll_inode(ino) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct wfs_grow grow;
+    memcpy(&grow, in_buf, sizeof(grow));
+    int rc = grow_image(&grow);
+    if (rc != 0) {
+        fuse_reply_err(req, -rc);
+    } else {
+        fuse_reply_ioctl(req, 0, &grow, sizeof(grow));
+    }
+}
+int ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) { //shared by mknod and mkdir, returns the new inode number or a negative errno
+    struct wfs_inode *dir = ll_dir(req, parent, name);
+    if (dir == NULL) {
+        return -ENOENT;
+    }
+    int rc = dir_create(dir, name, mode, 1);
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+        return rc;
+    }
+    struct fuse_entry_param e;
+    inode_rdlock(inode_at(rc));
+    ll_fill_entry(&e, inode_at(rc));
+    inode_unlock(inode_at(rc));
+    ll_reply_entry(req, &e);
+    return rc;
+}
+void wfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    TRACE_BEGIN();
+    int rc = ll_create(req, parent, name, mode);
+    TRACE_END(TRACE_MKNOD, rc < 0 ? -1 : rc, 0, 0, rc);
+}
+void wfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    TRACE_BEGIN();
+    int rc = ll_create(req, parent, name, mode | __S_IFDIR);
+    TRACE_END(TRACE_MKDIR, rc < 0 ? -1 : rc, 0, 0, rc);
+}
+int ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int is_dir) { //shared by unlink and rmdir, returns 0 or a negative errno
+    struct wfs_inode *dir = ll_dir(req, parent, name);
+    if (dir == NULL) {
+        return -ENOENT;
+    }
+    int rc = dir_remove(dir, name, is_dir);
+    fuse_reply_err(req, -rc);
+    return rc;
+}
+void wfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    TRACE_BEGIN();
+    int rc = ll_remove(req, parent, name, 0);
+    TRACE_END(TRACE_UNLINK, -1, 0, 0, rc);
+}
+void wfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    TRACE_BEGIN();
+    int rc = ll_remove(req, parent, name, 1);
+    TRACE_END(TRACE_RMDIR, -1, 0, 0, rc);
+}
+void wfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    TRACE_BEGIN();
+    struct wfs_inode *src_dir = ll_dir(req, parent, name);
+    if (src_dir == NULL) {
+        return;
+    }
+    struct wfs_inode *dst_dir = ll_dir(req, newparent, newname);
+    if (dst_dir == NULL) {
+        return;
+    }
+    int rc = dir_rename(src_dir, name, dst_dir, newname);
+    fuse_reply_err(req, -rc);
+    TRACE_END(TRACE_RENAME, -1, 0, 0, rc);
+}
+void wfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs st;
+    fill_statfs(&st);
+    fuse_reply_statfs(req, &st);
+}
+struct fuse_lowlevel_ops ll_ops = {
+    .lookup  = wfs_ll_lookup,
+    .forget  = wfs_ll_forget,
+    .getattr = wfs_ll_getattr,
+    .setattr = wfs_ll_setattr,
+    .mknod   = wfs_ll_mknod,
+    .mkdir   = wfs_ll_mkdir,
+    .unlink  = wfs_ll_unlink,
+    .rmdir   = wfs_ll_rmdir,
+    .rename  = wfs_ll_rename,
+    .open    = wfs_ll_open,
+    .release = wfs_ll_release,
+    .read    = wfs_ll_read,
+    .write   = wfs_ll_write,
+    .opendir = wfs_ll_opendir,
+    .readdir = wfs_ll_readdir,
+    .releasedir = wfs_ll_release,
+    .write_buf = wfs_ll_write_buf,
+    .flush   = wfs_ll_flush,
+    .fsync   = wfs_ll_fsync,
+    .fsyncdir = wfs_ll_fsyncdir,
+    .fallocate = wfs_ll_fallocate,
+    .ioctl   = wfs_ll_ioctl,
+    .statfs  = wfs_ll_statfs,
+    .init    = wfs_ll_init,
+    .destroy = wfs_destroy,
+};
+
+int mount_image(const char *disk_img) { //maps the image and sets up the in-memory state, 0 on success
     int fd = open(disk_img, O_RDWR);
     if (fd == -1) {
         perror("open");
         return 1;
     }
     struct stat st;
-    if (fstat(fd, &st) == -1) {
+    struct wfs_sb sb;
+    if (fstat(fd, &st) == -1 || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
         perror("fstat");
         return 1;
     }
-
-    void *img = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (!(sb.features & WFS_FEATURE_HASHDIR)) {
+        printf("%s uses linear directories, reformat it with this mkfs\n", disk_img);
+        return 1;
+    }
+    if (sb.i_bitmap_ptr < (off_t)sizeof(struct wfs_sb)) { //the newer superblock fields would land on the bitmap
+        printf("%s has an older superblock, reformat it with this mkfs\n", disk_img);
+        return 1;
+    }
+    if (sb.inode_size != 0 && (sb.inode_size < (int)sizeof(struct wfs_inode) || sb.inode_size > INODE_SLOT)) {
+        printf("%s has %d byte inodes, this wfs needs %zu to %d\n", disk_img, sb.inode_size, sizeof(struct wfs_inode), INODE_SLOT);
+        return 1;
+    }
+    if (journal_replay(fd, &sb) != 0) { //before mapping, so the mapping sees the replayed metadata
+        return 1;
+    }
+    int journaled = (sb.features & WFS_FEATURE_JOURNAL) != 0; //a private mapping: only journal commits write metadata back
+    size_t max_blocks = sb.max_data_blocks ? sb.max_data_blocks : sb.num_data_blocks;
+    image_size = sb.d_blocks_ptr + max_blocks * (sb.block_size ? sb.block_size : BLOCK_SIZE); //past the end of the file until it grows
+    if (image_size < (size_t)st.st_size) {
+        image_size = st.st_size;
+    }
+    void *img = mmap(NULL, image_size, PROT_READ | PROT_WRITE, journaled ? MAP_PRIVATE : MAP_SHARED, fd, 0);
     if (img == MAP_FAILED) {
         perror("mmap");
         return 1;
     }
     image = (char *)img;
+    image_fd = fd;
     super = (struct wfs_sb *) image;
-    char* fuse_argv[argc - 1];
-    int fuse_argc = argc - 1;
-    fuse_argv[0] = strdup(argv[0]);
-    for (int i = 2; i < fuse_argc + 1; i++) {
-        fuse_argv[i - 1] = strdup(argv[i]);
+    geometry_init();
+    if (journal_open(fd, image, image_size, super) != 0 || writeback_init(fd, max_inodes) != 0) {
+        perror("journal");
+        return 1;
+    }
+    dcache_init();
+    if (locks_init() != 0 || alloc_map_init(max_blocks, journaled) != 0) {
+        perror("locks_init");
+        return 1;
     }
+    if (free_counts_init() != 0) {
+        perror("superblock");
+        return 1;
+    }
+    return 0;
+}
 
-    return fuse_main(fuse_argc, fuse_argv, &ops, NULL);
+#ifndef WFS_NO_MAIN
+int ll_main(int argc, char* argv[]) { //mounts and runs the low-level session, the fuse_main equivalent
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 || mountpoint == NULL) {
+        return 1;
+    }
+    int rc = 1;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(&args, &ll_ops, sizeof(ll_ops), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                rc = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+    return rc == 0 ? 0 : 1;
+}
+int main (int argc, char* argv[]) {
+    if (argc < 2 || mount_image(argv[1]) != 0) {
+        return 1;
+    }
+    int use_paths = 0; //--paths selects the path-based operations
+    char* fuse_argv[argc - 1];
+    int fuse_argc = 0;
+    fuse_argv[fuse_argc++] = strdup(argv[0]);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--paths") == 0) {
+            use_paths = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--writeback-cache") == 0) { //see conn_init
+            writeback_cache = 1;
+            continue;
+        }
+        fuse_argv[fuse_argc++] = strdup(argv[i]);
+    }
+    if (use_paths) {
+        return fuse_main(fuse_argc, fuse_argv, &ops, NULL);
+    }
+    return ll_main(fuse_argc, fuse_argv);
 }
+#endif
@@ -1,26 +1,48 @@
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
 #include <time.h>
 
 #define FUSE_USE_VERSION 30
 
-#define BLOCK_SIZE (512)
+#define BLOCK_SIZE (512)   /* Default data block size, mkfs -B picks another */
+#define MAX_BLOCK_SIZE (65536)
+#define INODE_SLOT (512)   /* Bytes reserved for each inode in the inode table, unless mkfs -P packs it */
+#define CACHE_LINE (64)
 #define MAX_NAME   (28)
 
 #define D_BLOCK    (6)
 #define IND_BLOCK  (D_BLOCK+1)
-#define N_BLOCKS   (IND_BLOCK+1)
+#define DIND_BLOCK (IND_BLOCK+1)
+#define TIND_BLOCK (DIND_BLOCK+1)
+#define N_BLOCKS   (TIND_BLOCK+1)
+
+/* Superblock feature flags */
+#define WFS_FEATURE_EXTENTS (1 << 0) /* regular files map their data with extents */
+#define WFS_FEATURE_HASHDIR (1 << 1) /* directories are hash tables of dentries */
+#define WFS_FEATURE_JOURNAL (1 << 2) /* metadata changes go through the journal region */
+#define WFS_FEATURE_INLINE  (1 << 3) /* small regular files keep their data in the inode slot */
 
 
 /*
   The fields in the superblock should reflect the structure of the filesystem.
   `mkfs` writes the superblock to offset 0 of the disk image. 
+  Data blocks are block_size bytes and d_blocks_ptr is aligned to block_size.
+  Inode num lives at i_blocks_ptr + num * inode_size, i_blocks_ptr is
+  aligned to CACHE_LINE.
+  The bitmaps and the inode table are sized for max_inodes and
+  max_data_blocks, so WFS_IOC_GROW can raise num_inodes and num_data_blocks
+  on a mounted image by extending the file past the data blocks.
+  The journal region is empty (j_size 0) unless mkfs was given -j.
+  The free counts can only be trusted when clean is set; a mount that finds
+  it clear recounts them from the bitmaps.
   The disk image will have this format:
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
+          d_bitmap_ptr         j_ptr     d_blocks_ptr
+               v                 v           v
++----+---------+---------+--------+---------+--------------------------+
+| SB | IBITMAP | DBITMAP | INODES | JOURNAL |       DATA BLOCKS        |
++----+---------+---------+--------+---------+--------------------------+
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
@@ -34,7 +56,48 @@ struct wfs_sb {
     off_t d_bitmap_ptr;
     off_t i_blocks_ptr;
     off_t d_blocks_ptr;
+    int features;     /* WFS_FEATURE_* flags chosen by mkfs */
+    int block_size;   /* Data block size in bytes, a power of two */
+    off_t j_ptr;      /* Journal region, block aligned */
+    off_t j_size;     /* Bytes, 0 without WFS_FEATURE_JOURNAL */
+    int inode_size;   /* Inode table stride in bytes, INODE_SLOT or PACKED_INODE_SLOT */
+    size_t max_inodes;      /* Room the inode bitmap and table have, 0 means num_inodes */
+    size_t max_data_blocks; /* Room the data bitmap has, 0 means num_data_blocks */
+    size_t free_inodes;       /* Clear bits in the inode bitmap, kept up to date by wfs */
+    size_t free_data_blocks;  /* Clear bits in the data bitmap */
+    int clean;        /* 1 once an unmount wrote everything back, 0 while mounted */
+};
+/*
+  Online growth, an ioctl on any file or directory of the mounted image.
+  Each count is the wanted total, rounded up to a multiple of 32; 0 keeps
+  it. Counts never shrink (EINVAL) and cannot pass the room mkfs -g
+  reserved, max_inodes and max_data_blocks (EFBIG). On success the struct
+  holds the totals in effect and those limits, so all zeros just asks.
+*/
+struct wfs_grow {
+    size_t num_inodes;
+    size_t num_data_blocks;
+    size_t max_inodes;        /* out: the most num_inodes can grow to */
+    size_t max_data_blocks;   /* out: the most num_data_blocks can grow to */
+};
+#define WFS_IOC_GROW _IOWR('W', 1, struct wfs_grow)
+// Extent: a run of physically contiguous data blocks, or a hole
+struct wfs_extent {
+    int start;        /* Index of the first data block, WFS_EXTENT_HOLE for a hole */
+    int len;          /* Number of blocks, 0 if the slot is unused */
 };
+#define N_EXTENTS  ((int)(N_BLOCKS * sizeof(off_t) / sizeof(struct wfs_extent)))
+/*
+  Extents follow each other in logical order, so each one's logical start is
+  the sum of the lengths before it. A hole extent covers len unmapped blocks
+  inside the file; the list never ends with one. When a file needs more than
+  N_EXTENTS - 1 extents, the last slot becomes a link: len is WFS_EXTENT_LINK
+  and start is a data block holding more extents, whose own last slot may
+  link again. An array that links on may leave unused slots before its link;
+  in the last array the first unused slot ends the list.
+*/
+#define WFS_EXTENT_LINK (-1)
+#define WFS_EXTENT_HOLE (-1)
 // Inode
 struct wfs_inode {
     int     num;      /* Inode number */
@@ -43,19 +106,107 @@ struct wfs_inode {
     gid_t   gid;      /* Group ID of owner */
     off_t   size;     /* Total size, in bytes */
     int     nlinks;   /* Number of links */
+    int     used_blocks; /* Regular files: data blocks held, indirect and extent blocks included */
     time_t atim;      /* Time of last access */
     time_t mtim;      /* Time of last modification */
     time_t ctim;      /* Time of last status change */
 
-    off_t blocks[N_BLOCKS];
+    union {
+        off_t blocks[N_BLOCKS];
+        /* Regular files on WFS_FEATURE_EXTENTS images, in logical order */
+        struct wfs_extent extents[N_EXTENTS];
+    };
+    int     dir_blocks; /* Directories: blocks in the dentry hash table, 0 or a power of two */
+    int     flags;    /* WFS_INODE_* */
 };
+/* Stride of a packed inode table: whole cache lines, so no inode straddles two */
+#define PACKED_INODE_SLOT ((int)((sizeof(struct wfs_inode) + CACHE_LINE - 1) & ~(CACHE_LINE - 1)))
+/*
+  On WFS_FEATURE_INLINE images a regular file starts out with WFS_INODE_INLINE:
+  its bytes live right after struct wfs_inode in the same slot, up to
+  inode_size - sizeof(struct wfs_inode), and blocks[] stays empty. The first
+  write past that moves the data to blocks and clears the flag for good.
+*/
+#define WFS_INODE_INLINE (1 << 0)
 struct wfs_inode_and_child {
     struct wfs_inode *inode;
     char child[MAX_NAME];
 };
 
+/*
+  Journal. The first block of the region holds the header, the rest is a
+  log of transactions written front to back. A transaction is a
+  wfs_journal_txn followed by `ranges` wfs_journal_range records, each
+  followed by its len bytes. Replay applies transactions from the start of
+  the log for as long as their seq counts up from header.seq and their
+  checksum matches, then bumps header.seq past them. A revoke range carries
+  no bytes: the metadata block there was freed and may now hold file data,
+  so earlier transactions' copies of it are not replayed.
+*/
+#define WFS_JOURNAL_MAGIC  (0x57464a4cu) /* "WFJL" */
+#define WFS_JOURNAL_REVOKE (1ull << 63)  /* set in wfs_journal_range.len */
+struct wfs_journal_header {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t seq;       /* First transaction that still needs replay */
+};
+struct wfs_journal_txn {
+    uint32_t magic;
+    uint32_t ranges;
+    uint64_t seq;
+    uint64_t bytes;     /* Whole transaction, header included */
+    uint64_t checksum;  /* FNV-1a of everything after this header, and seq */
+};
+struct wfs_journal_range {
+    uint64_t offset;    /* Home location in the image */
+    uint64_t len;
+};
+
 // Directory entry
 struct wfs_dentry {
     char name[MAX_NAME];
     int num;
 };
+/*
+  No transaction may outgrow the log. wfs cuts journaled work into steps
+  with a known worst case, and the journal keeps that much of the log free
+  for every step in flight, committing early when it can't. A step
+  allocates or frees at most WFS_JOURNAL_STEP data blocks of one file:
+  longer writes are cut short, and truncate, fallocate, hole punching and
+  freeing a deleted file loop. wfs_step_reserve bounds such a step.
+  Creating, removing or renaming a name may also double or free a
+  directory table, up to one sized for max_inodes entries, and touches up
+  to four inodes; wfs_dir_reserve bounds that, and mkfs refuses a journal
+  whose log is smaller.
+*/
+#define WFS_JOURNAL_STEP  (512)
+#define WFS_JOURNAL_CHUNK (64)  /* granularity the journal logs changes at */
+static inline size_t wfs_step_reserve(size_t block_size, size_t inode_size) { //log bytes one step may need
+    size_t record = WFS_JOURNAL_CHUNK + sizeof(struct wfs_journal_range); //a chunk logged on its own
+    size_t chunks = 2 * (inode_size / WFS_JOURNAL_CHUNK + 1) + 4           //the inode, superblock and inode bitmap
+        + WFS_JOURNAL_STEP                                                  //data bitmap, every block in its own chunk at worst
+        + WFS_JOURNAL_STEP * sizeof(off_t) / WFS_JOURNAL_CHUNK + 4          //block pointers or extent slots
+        + (WFS_JOURNAL_STEP / 8 + 8) * (block_size / WFS_JOURNAL_CHUNK + 1); //indirect and extent blocks, written whole
+    return sizeof(struct wfs_journal_txn) + chunks * record;
+}
+static inline size_t wfs_dir_reserve(size_t max_inodes, size_t block_size, size_t inode_size) { //log bytes a name operation may need
+    size_t record = WFS_JOURNAL_CHUNK + sizeof(struct wfs_journal_range);
+    size_t table = 1; //blocks in the largest table: it doubles before it is 3/4 full
+    while (max_inodes * 4 > table * (block_size / sizeof(struct wfs_dentry)) * 3) {
+        table *= 2;
+    }
+    table += table / (block_size / sizeof(off_t)) + 3; //and the indirect blocks mapping it
+    size_t chunks = 2 * (inode_size / WFS_JOURNAL_CHUNK + 1) //two more inodes
+        + table * (block_size / WFS_JOURNAL_CHUNK + 1)       //a doubled table, written whole
+        + 2 * table;                                         //bitmap chunks of the old table and of an emptied one
+    size_t revokes = 2 * table * (block_size / WFS_JOURNAL_CHUNK) * sizeof(struct wfs_journal_range);
+    return wfs_step_reserve(block_size, inode_size) + chunks * record + revokes;
+}
+/* Home slot of a name in a directory's hash table, masked by the caller; mkfs -r lays tables out with it too */
+static inline unsigned int dir_hash(const char *name) {
+    unsigned int hash = 2166136261u; // FNV-1a
+    for(const char *c = name; *c; ++c) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
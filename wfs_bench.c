@@ -0,0 +1,252 @@
+#include "wfs.h"
+#include "journal.h"
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+  In-process benchmark. Formats a scratch image (on tmpfs by default) with
+  mkfs's format_image, mounts it with wfs's mount_image and calls the ops
+  table directly, so no kernel round trip is measured. Every call is timed.
+  Each phase prints one JSON line with its throughput and latency
+  percentiles, so results can be diffed between commits.
+*/
+int format_image(const char *disk_img, size_t num_inodes, size_t inode_size, size_t num_blocks, size_t block_size, size_t journal_blocks, size_t growth, int features);
+int mount_image(const char *disk_img);
+extern struct fuse_operations ops;
+
+#define USAGE "Usage: %s [-p image] [-b num_blocks] [-B block_size] [-e] [-I] [-P] [-j journal_blocks] [-d dirs] [-f files_per_dir]\n" \
+              "          [-w files_written] [-s file_size] [-o io_size] [-t tag]\n" \
+              "  defaults: -p /dev/shm/wfs_bench.img -b 131072 -B 512 -d 16 -f 256 -w 64 -s 262144 -o 4096\n"
+
+struct bench_args {
+    const char *image;
+    size_t num_blocks;
+    size_t block_size;
+    size_t journal_blocks;
+    size_t inode_size;
+    int features;
+    int dirs;
+    int fanout;         // files per directory
+    int files_written;  // files that get data, taken from the first directories
+    size_t file_size;
+    size_t io_size;
+    const char *tag;    // copied into every result line
+};
+struct bench_args args;
+
+struct phase {
+    const char *op;
+    double *latency; // ns, one per call
+    long calls;
+    long errors;
+    double start;
+};
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+void parse_bench_args(int argc, char *argv[]) {
+    args.image = "/dev/shm/wfs_bench.img";
+    args.num_blocks = 131072;
+    args.block_size = BLOCK_SIZE;
+    args.journal_blocks = 0;
+    args.inode_size = INODE_SLOT;
+    args.features = 0;
+    args.dirs = 16;
+    args.fanout = 256;
+    args.files_written = 64;
+    args.file_size = 256 * 1024;
+    args.io_size = 4096;
+    args.tag = "";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-e") == 0) {
+            args.features |= WFS_FEATURE_EXTENTS;
+        } else if (strcmp(argv[i], "-I") == 0) {
+            args.features |= WFS_FEATURE_INLINE;
+        } else if (strcmp(argv[i], "-P") == 0) {
+            args.inode_size = PACKED_INODE_SLOT;
+        } else if (i + 1 == argc) {
+            printf(USAGE, argv[0]);
+            exit(1);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            args.image = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0) {
+            args.num_blocks = (strtoul(argv[++i], NULL, 0) + 31) & ~31ul;
+        } else if (strcmp(argv[i], "-B") == 0) {
+            args.block_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-j") == 0) {
+            args.journal_blocks = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            args.dirs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            args.fanout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            args.files_written = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            args.file_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            args.io_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            args.tag = argv[++i];
+        } else {
+            printf(USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (args.dirs < 1 || args.fanout < 1 || args.io_size == 0) {
+        printf(USAGE, argv[0]);
+        exit(1);
+    }
+    if (args.files_written > args.dirs * args.fanout) {
+        args.files_written = args.dirs * args.fanout;
+    }
+}
+
+void phase_begin(struct phase *p, const char *op, long max_calls) {
+    p->op = op;
+    p->latency = malloc(max_calls * sizeof(double) + 1);
+    p->calls = 0;
+    p->errors = 0;
+    p->start = now_ns();
+}
+void phase_call(struct phase *p, double start, int rc) {
+    p->latency[p->calls++] = now_ns() - start;
+    if (rc < 0) {
+        p->errors++;
+    }
+}
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+void phase_end(struct phase *p) {
+    double elapsed = now_ns() - p->start;
+    qsort(p->latency, p->calls, sizeof(double), compare_double);
+    double p50 = p->calls ? p->latency[p->calls / 2] : 0;
+    double p99 = p->calls ? p->latency[p->calls * 99 / 100] : 0;
+    printf("{\"tag\":\"%s\",\"op\":\"%s\",\"calls\":%ld,\"errors\":%ld,\"ops_per_sec\":%.0f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+        "\"block_size\":%zu,\"extents\":%d,\"inline\":%d,\"inode_size\":%zu,\"journal\":%zu,\"dirs\":%d,\"fanout\":%d,\"file_size\":%zu,\"io_size\":%zu}\n",
+        args.tag, p->op, p->calls, p->errors, p->calls / (elapsed / 1e9), p50 / 1e3, p99 / 1e3,
+        args.block_size, (args.features & WFS_FEATURE_EXTENTS) != 0, (args.features & WFS_FEATURE_INLINE) != 0, args.inode_size, args.journal_blocks, args.dirs, args.fanout, args.file_size, args.io_size);
+    fflush(stdout);
+    free(p->latency);
+}
+
+int count_entry(void *buf, const char *name, const struct stat *st, off_t off) {
+    (*(long *)buf)++;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    parse_bench_args(argc, argv);
+    long files = (long)args.dirs * args.fanout;
+    size_t num_inodes = (files + args.dirs + 1 + 31) & ~31ul;
+    // generous upper bound on the formatted size: metadata, alignment and data
+    size_t image_size = sizeof(struct wfs_sb) + num_inodes / 8 + args.num_blocks / 8 + 8 + CACHE_LINE + num_inodes * args.inode_size
+        + (args.num_blocks + args.journal_blocks + 1) * args.block_size;
+    int fd = open(args.image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, image_size) == -1) {
+        perror(args.image);
+        return 1;
+    }
+    close(fd);
+    if (format_image(args.image, num_inodes, args.inode_size, args.num_blocks, args.block_size, args.journal_blocks, 1, args.features) != 0 || mount_image(args.image) != 0) {
+        return 1;
+    }
+    ops.init(NULL); //starts the journal thread, as fuse would
+
+    char (*dir_paths)[32] = malloc(args.dirs * sizeof(*dir_paths));
+    char (*file_paths)[48] = malloc(files * sizeof(*file_paths));
+    for(int d = 0; d < args.dirs; ++d) {
+        sprintf(dir_paths[d], "/d%d", d);
+        for(int f = 0; f < args.fanout; ++f) {
+            sprintf(file_paths[(long)d * args.fanout + f], "/d%d/f%d", d, f);
+        }
+    }
+    long chunks = (args.file_size + args.io_size - 1) / args.io_size;
+    char *buf = malloc(args.io_size);
+    memset(buf, 'w', args.io_size);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    struct stat st;
+    struct phase p;
+    double start;
+
+    phase_begin(&p, "mkdir", args.dirs);
+    for(int d = 0; d < args.dirs; ++d) {
+        start = now_ns();
+        phase_call(&p, start, ops.mkdir(dir_paths[d], 0755));
+    }
+    phase_end(&p);
+
+    phase_begin(&p, "mknod", files);
+    for(long i = 0; i < files; ++i) {
+        start = now_ns();
+        phase_call(&p, start, ops.mknod(file_paths[i], S_IFREG | 0644, 0));
+    }
+    phase_end(&p);
+
+    phase_begin(&p, "getattr", files);
+    for(long i = 0; i < files; ++i) {
+        start = now_ns();
+        phase_call(&p, start, ops.getattr(file_paths[i], &st));
+    }
+    phase_end(&p);
+
+    phase_begin(&p, "readdir", args.dirs);
+    for(int d = 0; d < args.dirs; ++d) {
+        long entries = 0;
+        start = now_ns();
+        phase_call(&p, start, ops.readdir(dir_paths[d], &entries, count_entry, 0, &fi));
+    }
+    phase_end(&p);
+
+    phase_begin(&p, "write", args.files_written * chunks);
+    for(long i = 0; i < args.files_written; ++i) {
+        ops.open(file_paths[i], &fi); //untimed, like a client streaming through one open file
+        for(long c = 0; c < chunks; ++c) {
+            size_t size = c == chunks - 1 ? args.file_size - c * args.io_size : args.io_size;
+            start = now_ns();
+            phase_call(&p, start, ops.write(file_paths[i], buf, size, c * args.io_size, &fi));
+        }
+        ops.release(file_paths[i], &fi);
+    }
+    phase_end(&p);
+
+    phase_begin(&p, "read", args.files_written * chunks);
+    for(long i = 0; i < args.files_written; ++i) {
+        ops.open(file_paths[i], &fi);
+        for(long c = 0; c < chunks; ++c) {
+            start = now_ns();
+            phase_call(&p, start, ops.read(file_paths[i], buf, args.io_size, c * args.io_size, &fi));
+        }
+        ops.release(file_paths[i], &fi);
+    }
+    phase_end(&p);
+
+    phase_begin(&p, "unlink", files);
+    for(long i = 0; i < files; ++i) {
+        start = now_ns();
+        phase_call(&p, start, ops.unlink(file_paths[i]));
+    }
+    phase_end(&p);
+
+    phase_begin(&p, "rmdir", args.dirs);
+    for(int d = 0; d < args.dirs; ++d) {
+        start = now_ns();
+        phase_call(&p, start, ops.rmdir(dir_paths[d]));
+    }
+    phase_end(&p);
+
+    journal_close(); //final commit, so the phases pay for the commits they caused
+    unlink(args.image);
+    return 0;
+}
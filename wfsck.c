@@ -0,0 +1,590 @@
+#include "wfs.h"
+#include "bitmap.h"
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+  Offline checker for an unmounted image. A committed journal is replayed
+  first, as a mount would. Worker threads then walk the tree from the root:
+  each takes a reached inode off a shared queue, claims the blocks its map
+  points to in a scratch bitmap, and for a directory checks every dentry
+  against the inode table and its hash table and queues the inodes reached
+  for the first time. Blocks claimed twice and dentries that point nowhere
+  are reported. Afterwards the bitmaps are compared with what was reached,
+  split across the workers by word: inodes and blocks that are allocated
+  but unreachable have leaked and are freed, reachable ones that are free
+  are marked used. Link counts, directory sizes, used_blocks and the free
+  counts are corrected, and an image with nothing left wrong is marked
+  clean so the next mount skips its scan.
+  The exit status follows fsck: 0 clean, 1 repaired, 4 errors left, 8 the
+  check could not run.
+*/
+#define USAGE "Usage: %s [-n] [-t threads] disk_img\n" \
+              "  -n  report only, write nothing (a pending journal is not replayed)\n" \
+              "  -t  worker threads (default: online CPUs)\n"
+#define MAX_THREADS (64)
+
+char *image;
+struct wfs_sb *super;
+long block_size;
+int dentries_per_block;
+int ptrs_per_block;
+int extents_per_block;
+long inode_size;
+long inline_capacity;
+int repair;
+int free_leaks;       // repair found nothing it can't fix, so unreachable means leaked
+uint32_t *reached;    // inodes reached from the root
+uint32_t *claimed;    // data blocks some reached inode maps
+int *links;           // dentries naming each inode
+long errors_left;
+long errors_fixed;
+
+/*
+  The work queue: inode numbers reached but not checked yet. pending counts
+  those plus the ones being checked; the walk is over when it drops to 0.
+*/
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+int *queue;
+long queued;
+long pending;
+
+void queue_push(int num) {
+    pthread_mutex_lock(&queue_lock);
+    queue[queued++] = num;
+    ++pending;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+int queue_pop() { //-1 once every reached inode is checked
+    pthread_mutex_lock(&queue_lock);
+    while (queued == 0 && pending > 0) {
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+    int num = queued > 0 ? queue[--queued] : -1;
+    pthread_mutex_unlock(&queue_lock);
+    return num;
+}
+void queue_done() {
+    pthread_mutex_lock(&queue_lock);
+    if (--pending == 0) {
+        pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void problem(int fixed) { //counts one finding, fixed if it was repaired
+    __atomic_fetch_add(fixed ? &errors_fixed : &errors_left, 1, __ATOMIC_RELAXED);
+}
+int test_and_set(uint32_t *map, size_t position) { //atomically, returns the old bit
+    uint32_t mask = UINT32_C(1) << (31 - position % 32);
+    return (__atomic_fetch_or(&map[position / 32], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+struct wfs_inode *inode_at(int num) {
+    return (struct wfs_inode *)(image + super->i_blocks_ptr + (off_t)num * inode_size);
+}
+off_t block_address(long index) {
+    return super->d_blocks_ptr + (off_t)block_size * index;
+}
+long block_index(off_t address) { //-1 unless address is the start of a data block
+    if (address < super->d_blocks_ptr || (address - super->d_blocks_ptr) % block_size != 0) {
+        return -1;
+    }
+    long index = (address - super->d_blocks_ptr) / block_size;
+    return (size_t)index < super->num_data_blocks ? index : -1;
+}
+int claim(int num, long index) { //0, or -1 if another inode (or this one) mapped the block already
+    if (test_and_set(claimed, index)) {
+        printf("inode %d: block %ld is mapped twice\n", num, index);
+        problem(0);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Block maps. The walks claim every block an inode holds, indirect and
+  extent blocks included, and return how many that is, or -1 after
+  reporting a pointer outside the data blocks.
+*/
+long claim_tree(int num, off_t address, int depth) {
+    long index = block_index(address);
+    if (index == -1) {
+        printf("inode %d: block pointer %ld is outside the data blocks\n", num, (long)address);
+        problem(0);
+        return -1;
+    }
+    if (claim(num, index) != 0) {
+        return 1; //already walked, don't follow it again
+    }
+    long count = 1;
+    if (depth > 0) {
+        off_t *pointers = (off_t *)(image + address);
+        for(int i = 0; i < ptrs_per_block; ++i) {
+            if (pointers[i] != 0) {
+                long below = claim_tree(num, pointers[i], depth - 1);
+                if (below == -1) {
+                    return -1;
+                }
+                count += below;
+            }
+        }
+    }
+    return count;
+}
+long claim_pointers(struct wfs_inode *inode) {
+    long count = 0;
+    for(int j = 0; j < N_BLOCKS; ++j) {
+        if (inode->blocks[j] != 0) {
+            long below = claim_tree(inode->num, inode->blocks[j], j <= D_BLOCK ? 0 : j - D_BLOCK);
+            if (below == -1) {
+                return -1;
+            }
+            count += below;
+        }
+    }
+    return count;
+}
+long claim_extents(struct wfs_inode *inode) {
+    struct wfs_extent *slot = inode->extents;
+    int left = N_EXTENTS;
+    long count = 0;
+    while (left > 0) {
+        struct wfs_extent *link = slot + left - 1;
+        if (link->len == WFS_EXTENT_LINK && (slot == link || slot->len == 0)) { //unused slots may come before a link
+            if (link->start < 0 || (size_t)link->start >= super->num_data_blocks) {
+                slot = link;
+                break;
+            }
+            if (claim(inode->num, link->start) != 0) {
+                return -1; //a link back into the list would never end
+            }
+            ++count;
+            slot = (struct wfs_extent *)(image + block_address(link->start));
+            left = extents_per_block;
+            continue;
+        }
+        if (slot->len == 0) {
+            break;
+        }
+        if (slot->start == WFS_EXTENT_HOLE && slot->len > 0) {
+            ++slot;
+            --left;
+            continue;
+        }
+        if (slot->start < 0 || slot->len < 0 || (size_t)slot->start + slot->len > super->num_data_blocks) {
+            break;
+        }
+        for(long k = 0; k < slot->len; ++k) {
+            claim(inode->num, slot->start + k);
+        }
+        count += slot->len;
+        ++slot;
+        --left;
+    }
+    if (left > 0 && slot->len != 0) {
+        printf("inode %d: extent %d+%d is outside the data blocks\n", inode->num, slot->start, slot->len);
+        problem(0);
+        return -1;
+    }
+    return count;
+}
+off_t block_pointer(struct wfs_inode *inode, long lblk) { //as in wfs, 0 for a missing or out of range pointer
+    if (lblk <= D_BLOCK) {
+        return block_index(inode->blocks[lblk]) == -1 ? 0 : inode->blocks[lblk];
+    }
+    lblk -= IND_BLOCK;
+    long span = ptrs_per_block;
+    int level = IND_BLOCK;
+    while (lblk >= span) {
+        lblk -= span;
+        ++level;
+        if (level > TIND_BLOCK) {
+            return 0;
+        }
+        span *= ptrs_per_block;
+    }
+    off_t address = inode->blocks[level];
+    for(int depth = level - D_BLOCK; depth > 0; --depth) {
+        if (block_index(address) == -1) {
+            return 0;
+        }
+        span /= ptrs_per_block;
+        address = ((off_t *)(image + address))[lblk / span];
+        lblk %= span;
+    }
+    return block_index(address) == -1 ? 0 : address;
+}
+
+/*
+  Directories. Every live dentry must name an allocated inode that knows
+  its own number, and sit exactly where a probe for its name ends, which
+  also rules out two entries with the same name.
+*/
+struct wfs_dentry *dir_slot(struct wfs_inode *dir, long slot) {
+    return (struct wfs_dentry *)(image + block_pointer(dir, slot / dentries_per_block)) + slot % dentries_per_block;
+}
+int probe_ends_at(struct wfs_inode *dir, const char *name, long slot) {
+    long mask = (long)dir->dir_blocks * dentries_per_block - 1;
+    long at = dir_hash(name) & mask;
+    for(long steps = 0; steps <= mask; ++steps) {
+        struct wfs_dentry *entry = dir_slot(dir, at);
+        if (entry->num == -1 || strcmp(entry->name, name) == 0) {
+            return at == slot;
+        }
+        at = (at + 1) & mask;
+    }
+    return 0;
+}
+int dentry_valid(struct wfs_inode *dir, struct wfs_dentry *entry, long slot) {
+    if (memchr(entry->name, '\0', MAX_NAME) == NULL || entry->name[0] == '\0' || strchr(entry->name, '/') != NULL) {
+        printf("directory %d: slot %ld has a malformed name\n", dir->num, slot);
+        return 0;
+    }
+    if (entry->num <= 0 || (size_t)entry->num >= super->num_inodes || !bitmap_get((uint32_t *)(image + super->i_bitmap_ptr), entry->num)) {
+        printf("directory %d: %s names inode %d, which is not allocated\n", dir->num, entry->name, entry->num);
+        return 0;
+    }
+    struct wfs_inode *child = inode_at(entry->num);
+    if (child->num != entry->num || (!S_ISDIR(child->mode) && !S_ISREG(child->mode))) {
+        printf("directory %d: %s names inode %d, which is not a file or directory\n", dir->num, entry->name, entry->num);
+        return 0;
+    }
+    if (!probe_ends_at(dir, entry->name, slot)) {
+        printf("directory %d: %s is in slot %ld, where lookups can't find it\n", dir->num, entry->name, slot);
+        return 0;
+    }
+    return 1;
+}
+void check_dir(struct wfs_inode *dir) { //caller claimed its blocks; only this worker touches dir
+    if (dir->dir_blocks < 0 || (dir->dir_blocks & (dir->dir_blocks - 1)) != 0) {
+        printf("directory %d: table of %d blocks is not a power of two\n", dir->num, dir->dir_blocks);
+        problem(0);
+        return;
+    }
+    for(long i = 0; i < dir->dir_blocks; ++i) {
+        if (block_pointer(dir, i) == 0) {
+            printf("directory %d: table block %ld is missing\n", dir->num, i);
+            problem(0);
+            return;
+        }
+    }
+    long slots = (long)dir->dir_blocks * dentries_per_block;
+    long live = 0;
+    int subdirs = 0;
+    for(long slot = 0; slot < slots; ++slot) {
+        struct wfs_dentry *entry = dir_slot(dir, slot);
+        if (entry->num == -1) {
+            continue;
+        }
+        ++live;
+        if (!dentry_valid(dir, entry, slot)) {
+            problem(0);
+            continue;
+        }
+        struct wfs_inode *child = inode_at(entry->num);
+        __atomic_fetch_add(&links[entry->num], 1, __ATOMIC_RELAXED);
+        if (S_ISDIR(child->mode)) {
+            ++subdirs;
+        }
+        if (!test_and_set(reached, entry->num)) {
+            queue_push(entry->num);
+        } else if (S_ISDIR(child->mode)) {
+            printf("directory %d: %s is a second link to directory %d\n", dir->num, entry->name, entry->num);
+            problem(0);
+        }
+    }
+    if (dir->size != live * (off_t)sizeof(struct wfs_dentry)) {
+        printf("directory %d: size is %ld for %ld entries\n", dir->num, (long)dir->size, live);
+        if (repair) {
+            dir->size = live * sizeof(struct wfs_dentry);
+        }
+        problem(repair);
+    }
+    if (dir->nlinks != 2 + subdirs) {
+        printf("directory %d: link count is %d, should be %d\n", dir->num, dir->nlinks, 2 + subdirs);
+        if (repair) {
+            dir->nlinks = 2 + subdirs;
+        }
+        problem(repair);
+    }
+}
+void check_inode(int num) {
+    struct wfs_inode *inode = inode_at(num);
+    if (inode->num != num || (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode))) {
+        printf("inode %d: not a file or directory\n", num);
+        problem(0);
+        return;
+    }
+    long held;
+    if (S_ISREG(inode->mode) && (inode->flags & WFS_INODE_INLINE)) {
+        held = 0;
+        if (inode->size > inline_capacity) {
+            printf("inode %d: inline file of %ld bytes, the slot holds %ld\n", num, (long)inode->size, inline_capacity);
+            problem(0);
+        }
+    } else if (S_ISREG(inode->mode) && (super->features & WFS_FEATURE_EXTENTS)) {
+        held = claim_extents(inode);
+    } else {
+        held = claim_pointers(inode);
+    }
+    if (held == -1) {
+        return;
+    }
+    if (inode->used_blocks != held) {
+        printf("inode %d: used_blocks is %d, it holds %ld\n", num, inode->used_blocks, held);
+        if (repair) {
+            inode->used_blocks = held;
+        }
+        problem(repair);
+    }
+    if (S_ISDIR(inode->mode)) {
+        check_dir(inode);
+    }
+}
+void *walk_worker(void *arg) {
+    int num;
+    while ((num = queue_pop()) != -1) {
+        check_inode(num);
+        queue_done();
+    }
+    return NULL;
+}
+
+/*
+  Bitmaps. Each worker compares its own range of words, so repairs never
+  touch a word another worker reads.
+*/
+struct compare_range {
+    size_t first;   // words
+    size_t end;
+    long leaked_inodes;
+    long leaked_blocks;
+    long lost_blocks; // mapped by a reachable inode but free in the bitmap
+};
+uint32_t valid_bits(size_t word, size_t nbits) { //mask of the bits of word below nbits
+    if ((word + 1) * 32 <= nbits) {
+        return UINT32_MAX;
+    }
+    return word * 32 >= nbits ? 0 : ~(UINT32_MAX >> (nbits - word * 32));
+}
+void *compare_worker(void *arg) {
+    struct compare_range *range = arg;
+    uint32_t *ibitmap = (uint32_t *)(image + super->i_bitmap_ptr);
+    uint32_t *dbitmap = (uint32_t *)(image + super->d_bitmap_ptr);
+    size_t inode_words = (super->num_inodes + 31) / 32;
+    size_t block_words = (super->num_data_blocks + 31) / 32;
+    for(size_t w = range->first; w < range->end; ++w) {
+        if (w < inode_words) {
+            uint32_t leaked = ibitmap[w] & ~reached[w] & valid_bits(w, super->num_inodes);
+            range->leaked_inodes += __builtin_popcount(leaked);
+            if (free_leaks) {
+                ibitmap[w] &= ~leaked;
+            }
+            for(int bit = 0; bit < 32 && w * 32 + bit < super->num_inodes; ++bit) {
+                int num = w * 32 + bit;
+                struct wfs_inode *inode = inode_at(num);
+                if (bitmap_get(reached, num) && S_ISREG(inode->mode) && inode->nlinks != links[num]) {
+                    printf("inode %d: link count is %d, %d dentries name it\n", num, inode->nlinks, links[num]);
+                    if (repair) {
+                        inode->nlinks = links[num];
+                    }
+                    problem(repair);
+                }
+            }
+        }
+        if (w < block_words) {
+            uint32_t valid = valid_bits(w, super->num_data_blocks);
+            uint32_t leaked = dbitmap[w] & ~claimed[w] & valid;
+            uint32_t lost = claimed[w] & ~dbitmap[w] & valid;
+            range->leaked_blocks += __builtin_popcount(leaked);
+            range->lost_blocks += __builtin_popcount(lost);
+            if (free_leaks) {
+                dbitmap[w] &= ~leaked;
+            }
+            if (repair) {
+                dbitmap[w] |= lost;
+            }
+        }
+    }
+    return NULL;
+}
+void compare_bitmaps(int threads) {
+    size_t inode_words = (super->num_inodes + 31) / 32;
+    size_t block_words = (super->num_data_blocks + 31) / 32;
+    size_t words = inode_words > block_words ? inode_words : block_words;
+    struct compare_range ranges[MAX_THREADS];
+    pthread_t workers[MAX_THREADS];
+    memset(ranges, 0, sizeof(ranges));
+    for(int t = 0; t < threads; ++t) {
+        ranges[t].first = words * t / threads;
+        ranges[t].end = words * (t + 1) / threads;
+        if (pthread_create(&workers[t], NULL, compare_worker, &ranges[t]) != 0) {
+            compare_worker(&ranges[t]);
+            workers[t] = 0;
+        }
+    }
+    long leaked_inodes = 0, leaked_blocks = 0, lost_blocks = 0;
+    for(int t = 0; t < threads; ++t) {
+        if (workers[t] != 0) {
+            pthread_join(workers[t], NULL);
+        }
+        leaked_inodes += ranges[t].leaked_inodes;
+        leaked_blocks += ranges[t].leaked_blocks;
+        lost_blocks += ranges[t].lost_blocks;
+    }
+    // with damage left the walk may have missed live data, so nothing is freed
+    const char *outcome = free_leaks ? ", freed" : repair ? ", kept until the errors above are fixed" : "";
+    if (leaked_inodes > 0) {
+        printf("%ld inodes are allocated but unreachable%s\n", leaked_inodes, outcome);
+        __atomic_fetch_add(free_leaks ? &errors_fixed : &errors_left, leaked_inodes, __ATOMIC_RELAXED);
+    }
+    if (leaked_blocks > 0) {
+        printf("%ld data blocks are allocated but unreachable%s\n", leaked_blocks, outcome);
+        __atomic_fetch_add(free_leaks ? &errors_fixed : &errors_left, leaked_blocks, __ATOMIC_RELAXED);
+    }
+    if (lost_blocks > 0) {
+        printf("%ld data blocks are in use but free in the bitmap%s\n", lost_blocks, repair ? ", marked used" : "");
+        __atomic_fetch_add(repair ? &errors_fixed : &errors_left, lost_blocks, __ATOMIC_RELAXED);
+    }
+}
+size_t free_inodes() {
+    return super->num_inodes - bitmap_popcount((uint32_t *)(image + super->i_bitmap_ptr), super->num_inodes);
+}
+size_t free_data_blocks() {
+    return super->num_data_blocks - bitmap_popcount((uint32_t *)(image + super->d_bitmap_ptr), super->num_data_blocks);
+}
+void check_free_counts() { //before the bitmaps are repaired, which moves the counts on purpose
+    if (super->clean && (super->free_inodes != free_inodes() || super->free_data_blocks != free_data_blocks())) { //a dirty image recounts at mount anyway
+        printf("free counts are %zu inodes and %zu blocks, should be %zu and %zu\n", super->free_inodes, super->free_data_blocks, free_inodes(), free_data_blocks());
+        problem(repair);
+    }
+}
+
+int check_superblock(const struct wfs_sb *sb, off_t file_size) {
+    long bs = sb->block_size ? sb->block_size : BLOCK_SIZE;
+    long stride = sb->inode_size ? sb->inode_size : INODE_SLOT;
+    size_t max_inodes = sb->max_inodes ? sb->max_inodes : sb->num_inodes;
+    if (!(sb->features & WFS_FEATURE_HASHDIR) || sb->i_bitmap_ptr < (off_t)sizeof(struct wfs_sb)) {
+        printf("not an image of this wfs, or an older format\n");
+        return -1;
+    }
+    if (bs < BLOCK_SIZE || bs > MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0 || stride < (long)sizeof(struct wfs_inode) || stride > INODE_SLOT
+        || sb->num_inodes == 0 || sb->num_inodes > max_inodes || sb->d_bitmap_ptr <= sb->i_bitmap_ptr || sb->i_blocks_ptr <= sb->d_bitmap_ptr
+        || sb->i_blocks_ptr + (off_t)(max_inodes * stride) > sb->d_blocks_ptr
+        || sb->d_blocks_ptr + (off_t)(sb->num_data_blocks * bs) > file_size) {
+        printf("superblock is damaged\n");
+        return -1;
+    }
+    return 0;
+}
+int main(int argc, char *argv[]) {
+    const char *disk_img = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    repair = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            repair = 0;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = strtol(argv[++i], NULL, 0);
+        } else if (disk_img == NULL && argv[i][0] != '-') {
+            disk_img = argv[i];
+        } else {
+            printf(USAGE, argv[0]);
+            return 8;
+        }
+    }
+    if (disk_img == NULL) {
+        printf(USAGE, argv[0]);
+        return 8;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+    int fd = open(disk_img, repair ? O_RDWR : O_RDONLY);
+    struct stat st;
+    struct wfs_sb sb;
+    if (fd == -1 || fstat(fd, &st) == -1 || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+        perror(disk_img);
+        return 8;
+    }
+    if (check_superblock(&sb, st.st_size) != 0) {
+        return 8;
+    }
+    if (repair && journal_replay(fd, &sb) != 0) {
+        return 8;
+    } else if (!repair && (sb.features & WFS_FEATURE_JOURNAL) && !sb.clean) {
+        printf("the journal may hold changes this check does not see\n");
+    }
+    void *img = mmap(NULL, st.st_size, repair ? PROT_READ | PROT_WRITE : PROT_READ, repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (img == MAP_FAILED) {
+        perror("mmap");
+        return 8;
+    }
+    image = (char *)img;
+    super = (struct wfs_sb *)image;
+    block_size = super->block_size ? super->block_size : BLOCK_SIZE;
+    dentries_per_block = block_size / sizeof(struct wfs_dentry);
+    ptrs_per_block = block_size / sizeof(off_t);
+    extents_per_block = block_size / sizeof(struct wfs_extent);
+    inode_size = super->inode_size ? super->inode_size : INODE_SLOT;
+    inline_capacity = (super->features & WFS_FEATURE_INLINE) ? inode_size - (long)sizeof(struct wfs_inode) : 0;
+    reached = calloc((super->num_inodes + 31) / 32, sizeof(uint32_t));
+    claimed = calloc((super->num_data_blocks + 31) / 32 + 1, sizeof(uint32_t));
+    links = calloc(super->num_inodes, sizeof(int));
+    queue = malloc(super->num_inodes * sizeof(int));
+    if (reached == NULL || claimed == NULL || links == NULL || queue == NULL) {
+        perror("calloc");
+        return 8;
+    }
+
+    struct wfs_inode *root = inode_at(0);
+    if (!bitmap_get((uint32_t *)(image + super->i_bitmap_ptr), 0) || root->num != 0 || !S_ISDIR(root->mode)) {
+        printf("the root directory is damaged\n");
+        return 8;
+    }
+    test_and_set(reached, 0);
+    queue_push(0);
+    pthread_t workers[MAX_THREADS];
+    long started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, walk_worker, NULL) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        walk_worker(NULL);
+    }
+    for(long i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free_leaks = repair && errors_left == 0;
+    check_free_counts();
+    compare_bitmaps(threads);
+
+    if (repair) {
+        super->free_inodes = free_inodes();
+        super->free_data_blocks = free_data_blocks();
+        if (errors_left == 0) {
+            super->clean = 1; //the next mount can trust the free counts
+        }
+        if (msync(img, st.st_size, MS_SYNC) == -1) {
+            perror("msync");
+            return 8;
+        }
+    }
+    printf("%s: %zu inodes, %zu data blocks in use; %ld problems repaired, %ld left\n", disk_img,
+        super->num_inodes - free_inodes(), super->num_data_blocks - free_data_blocks(), errors_fixed, errors_left);
+    munmap(img, st.st_size);
+    close(fd);
+    return errors_left > 0 ? 4 : errors_fixed > 0 ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+#include "wfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+  Grows a mounted wfs image with WFS_IOC_GROW. path is any file or
+  directory of the mount, usually the mount point. The image can only grow
+  into the room mkfs -g reserved, and a request past it is refused with
+  the limits named.
+*/
+#define USAGE "Usage: %s [-i num_inodes] [-b num_blocks] path\n" \
+              "  -i, -b  the new totals, rounded up to a multiple of 32; a count that is not given is kept\n" \
+              "  with neither, prints the current totals and the most mkfs -g left room for\n"
+
+int main(int argc, char *argv[]) {
+    struct wfs_grow grow;
+    memset(&grow, 0, sizeof(grow));
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            grow.num_inodes = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            grow.num_data_blocks = strtoul(argv[++i], NULL, 0);
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+    if (path == NULL) {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+    if (ioctl(fd, WFS_IOC_GROW, &grow) == -1) {
+        struct wfs_grow limits; //all zeros grows nothing and reports the limits
+        memset(&limits, 0, sizeof(limits));
+        if (errno == EFBIG && ioctl(fd, WFS_IOC_GROW, &limits) == 0) {
+            printf("%s was formatted with room for at most %zu inodes and %zu blocks; reformat it with mkfs -g factor to reserve room to grow\n",
+                path, limits.max_inodes, limits.max_data_blocks);
+        } else {
+            perror("WFS_IOC_GROW");
+        }
+        return 1;
+    }
+    close(fd);
+    printf("num_inodes: %zu\nnum_data_blocks: %zu\nmax_inodes: %zu\nmax_data_blocks: %zu\n", grow.num_inodes, grow.num_data_blocks, grow.max_inodes, grow.max_data_blocks);
+    return 0;
+}
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE //sync_file_range
+#include "wfs.h"
+#include "writeback.h"
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#define WRITEBACK_INTERVAL_S (1) // how often the thread looks for aged inodes
+#define WRITEBACK_AGE_S      (5) // dirty data older than this is written back
+
+struct wb_range {
+    off_t start;
+    off_t end;
+};
+struct wb_inode {
+    struct wb_range *ranges; // sorted, disjoint and not adjacent
+    int count;
+    int cap;
+    time_t since;            // when the inode became dirty, 0 if clean
+    int next;                // in the dirty queue, -1 at the tail
+    int queued;
+};
+
+int writeback_fd;
+struct wb_inode *wb_inodes;
+long wb_num_inodes;
+pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+int queue_head = -1; // dirty inodes, oldest first
+int queue_tail = -1;
+
+pthread_mutex_t wb_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wb_wake_cond = PTHREAD_COND_INITIALIZER;
+pthread_t wb_thread;
+int wb_thread_running;
+int wb_stopping;
+
+int writeback_init(int fd, long num_inodes) {
+    writeback_fd = fd;
+    wb_num_inodes = num_inodes;
+    wb_inodes = calloc(num_inodes, sizeof(struct wb_inode));
+    return wb_inodes == NULL ? -1 : 0;
+}
+
+int range_insert(struct wb_inode *wb, off_t start, off_t end) { //merges [start, end) into the sorted ranges, caller holds wb_lock
+    int i = wb->count;
+    while (i > 0 && wb->ranges[i - 1].start > end) { //appends land at the end, so scan from there
+        --i;
+    }
+    // ranges[i - 1] is the last one starting at or before end
+    if (i > 0 && wb->ranges[i - 1].end >= start) {
+        struct wb_range *r = &wb->ranges[i - 1];
+        r->start = start < r->start ? start : r->start;
+        r->end = end > r->end ? end : r->end;
+        int first = i - 1; //swallow earlier ranges that now touch it
+        while (first > 0 && wb->ranges[first - 1].end >= r->start) {
+            --first;
+            r->start = wb->ranges[first].start < r->start ? wb->ranges[first].start : r->start;
+        }
+        if (first < i - 1) {
+            wb->ranges[first] = *r;
+            memmove(&wb->ranges[first + 1], &wb->ranges[i], (wb->count - i) * sizeof(struct wb_range));
+            wb->count -= i - 1 - first;
+        }
+        return 0;
+    }
+    if (wb->count == wb->cap) {
+        int cap = wb->cap ? 2 * wb->cap : 4;
+        struct wb_range *grown = realloc(wb->ranges, cap * sizeof(struct wb_range));
+        if (grown == NULL) {
+            return -1;
+        }
+        wb->ranges = grown;
+        wb->cap = cap;
+    }
+    memmove(&wb->ranges[i + 1], &wb->ranges[i], (wb->count - i) * sizeof(struct wb_range));
+    wb->ranges[i].start = start;
+    wb->ranges[i].end = end;
+    wb->count++;
+    return 0;
+}
+void writeback_dirty(int num, off_t start, off_t len) { //called with the inode's write lock held
+    if (wb_inodes == NULL || len <= 0) {
+        return;
+    }
+    struct wb_inode *wb = &wb_inodes[num];
+    pthread_mutex_lock(&wb_lock);
+    if (range_insert(wb, start, start + len) != 0) {
+        pthread_mutex_unlock(&wb_lock);
+        sync_file_range(writeback_fd, start, len, SYNC_FILE_RANGE_WRITE); //can't remember it, start it now
+        return;
+    }
+    if (wb->since == 0) {
+        wb->since = time(NULL);
+    }
+    if (!wb->queued) {
+        wb->queued = 1;
+        wb->next = -1;
+        if (queue_tail == -1) {
+            queue_head = num;
+        } else {
+            wb_inodes[queue_tail].next = num;
+        }
+        queue_tail = num;
+    }
+    pthread_mutex_unlock(&wb_lock);
+}
+/*
+  Starts writeback of num's dirty ranges and, with wait, waits for it and
+  forgets them. Without wait (flush on close) the ranges stay recorded, since
+  only a waited sync proves they reached the disk.
+*/
+int writeback_sync(int num, int wait) {
+    if (wb_inodes == NULL) {
+        return 0;
+    }
+    struct wb_inode *wb = &wb_inodes[num];
+    pthread_mutex_lock(&wb_lock);
+    int count = wb->count;
+    struct wb_range *ranges = wb->ranges;
+    if (wait) {
+        wb->ranges = NULL;
+        wb->count = 0;
+        wb->cap = 0;
+        wb->since = 0;
+    } else {
+        ranges = malloc(count * sizeof(struct wb_range) + 1);
+        if (ranges == NULL) {
+            pthread_mutex_unlock(&wb_lock);
+            return -ENOMEM;
+        }
+        memcpy(ranges, wb->ranges, count * sizeof(struct wb_range));
+    }
+    pthread_mutex_unlock(&wb_lock);
+    unsigned int flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE;
+    int rc = 0;
+    for(int i = 0; i < count; ++i) {
+        if (sync_file_range(writeback_fd, ranges[i].start, ranges[i].end - ranges[i].start, flags) != 0) {
+            rc = -errno;
+        }
+    }
+    free(ranges);
+    return rc;
+}
+void writeback_forget(int num) { //num was freed; its blocks may already belong to another file
+    if (wb_inodes == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&wb_lock);
+    free(wb_inodes[num].ranges);
+    wb_inodes[num].ranges = NULL;
+    wb_inodes[num].count = 0;
+    wb_inodes[num].cap = 0;
+    wb_inodes[num].since = 0;
+    pthread_mutex_unlock(&wb_lock);
+}
+
+int writeback_aged(time_t now) { //pops the oldest dirty inode if it is due, -1 if none is
+    pthread_mutex_lock(&wb_lock);
+    while (queue_head != -1) {
+        struct wb_inode *wb = &wb_inodes[queue_head];
+        if (wb->since != 0 && now - wb->since < WRITEBACK_AGE_S) {
+            break; //the rest of the queue is younger
+        }
+        int num = queue_head;
+        queue_head = wb->next;
+        if (queue_head == -1) {
+            queue_tail = -1;
+        }
+        wb->queued = 0;
+        if (wb->since != 0) {
+            pthread_mutex_unlock(&wb_lock);
+            return num;
+        }
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return -1;
+}
+void *writeback_thread(void *arg) {
+    pthread_mutex_lock(&wb_wake_lock);
+    while (!wb_stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += WRITEBACK_INTERVAL_S;
+        pthread_cond_timedwait(&wb_wake_cond, &wb_wake_lock, &until);
+        pthread_mutex_unlock(&wb_wake_lock);
+        time_t now = time(NULL);
+        int num;
+        while ((num = writeback_aged(now)) != -1) {
+            writeback_sync(num, 1);
+        }
+        journal_commit(); //metadata; with a log the commit thread already does this more often
+        pthread_mutex_lock(&wb_wake_lock);
+    }
+    pthread_mutex_unlock(&wb_wake_lock);
+    return NULL;
+}
+int writeback_start_thread() { //after fuse has daemonized, like the journal thread
+    if (wb_inodes == NULL || wb_thread_running) {
+        return 0;
+    }
+    if (pthread_create(&wb_thread, NULL, writeback_thread, NULL) != 0) {
+        return -1;
+    }
+    wb_thread_running = 1;
+    return 0;
+}
+void writeback_stop() {
+    if (!wb_thread_running) {
+        return;
+    }
+    pthread_mutex_lock(&wb_wake_lock);
+    wb_stopping = 1;
+    pthread_cond_signal(&wb_wake_cond);
+    pthread_mutex_unlock(&wb_wake_lock);
+    pthread_join(wb_thread, NULL);
+    wb_thread_running = 0;
+}
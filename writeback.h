@@ -0,0 +1,19 @@
+#include <sys/types.h>
+
+/*
+  Per-inode dirty data ranges. File data is written through the image fd,
+  so it sits in the page cache until the kernel writes it back. Writes
+  record the image byte ranges they touched, coalesced per inode, and
+  writeback_sync writes and waits for just those ranges with
+  sync_file_range, so an fsync costs as much as the file's dirty data and
+  not the image's. A background thread syncs the ranges of inodes that
+  have been dirty for WRITEBACK_AGE_S seconds and commits metadata.
+  All state is guarded by one leaf mutex.
+*/
+
+int writeback_init(int fd, long num_inodes);
+void writeback_dirty(int num, off_t start, off_t len);
+int writeback_sync(int num, int wait);
+void writeback_forget(int num);
+int writeback_start_thread();
+void writeback_stop();